@@ -0,0 +1,302 @@
+// Runtime support for Natural++ programs compiled ahead of time with
+// `natural --emit-cpp` / `natural --compile`. The generated code keeps
+// proven-numeric variables in plain doubles and uses these types for
+// everything else. Semantics mirror the interpreter in natural.cpp.
+#ifndef NATURAL_RUNTIME_H
+#define NATURAL_RUNTIME_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace nrt {
+
+using namespace std;
+
+struct Value {
+  enum ValueType { V_NUMBER, V_STRING, V_LIST, V_OBJECT } type;
+  double num;
+  string str;
+  shared_ptr<vector<Value>> list_val;
+  shared_ptr<unordered_map<string, Value>> obj_val;
+
+  Value() : type(V_NUMBER), num(0) {}
+  Value(double n) : type(V_NUMBER), num(n) {}
+  Value(string s) : type(V_STRING), num(0), str(s) {}
+  Value(const char *s) : type(V_STRING), num(0), str(s) {}
+
+  static Value createList() {
+    Value v;
+    v.type = V_LIST;
+    v.list_val = make_shared<vector<Value>>();
+    return v;
+  }
+
+  static Value createObject() {
+    Value v;
+    v.type = V_OBJECT;
+    v.obj_val = make_shared<unordered_map<string, Value>>();
+    return v;
+  }
+
+  string stringify() const;
+  void write(ostream &out, vector<const void *> &path) const;
+
+  static string stringifyNumber(double n) {
+    string s = to_string(n);
+    s.erase(s.find_last_not_of('0') + 1, std::string::npos);
+    if (s.back() == '.')
+      s.pop_back();
+    return s;
+  }
+
+  bool isTruthy() const {
+    if (type == V_STRING)
+      return str.length() > 0;
+    if (type == V_NUMBER)
+      return num != 0;
+    return true;
+  }
+};
+
+// Streams the value; aggregates already on `path` print as [...] / {...},
+// as in the interpreter's ValueWriter.
+inline void Value::write(ostream &out, vector<const void *> &path) const {
+  if (type == V_STRING) {
+    out << str;
+    return;
+  }
+  if (type == V_NUMBER) {
+    out << stringifyNumber(num);
+    return;
+  }
+  const void *self = type == V_LIST ? (const void *)list_val.get()
+                                    : (const void *)obj_val.get();
+  for (const void *p : path) {
+    if (p == self) {
+      out << (type == V_LIST ? "[...]" : "{...}");
+      return;
+    }
+  }
+  path.push_back(self);
+  if (type == V_LIST) {
+    out << '[';
+    for (size_t i = 0; i < list_val->size(); i++) {
+      if (i > 0)
+        out << ", ";
+      (*list_val)[i].write(out, path);
+    }
+    out << ']';
+  } else {
+    out << '{';
+    bool first = true;
+    for (auto const &pair : *obj_val) {
+      if (!first)
+        out << ", ";
+      out << pair.first << ": ";
+      pair.second.write(out, path);
+      first = false;
+    }
+    out << '}';
+  }
+  path.pop_back();
+}
+
+inline string Value::stringify() const {
+  if (type == V_STRING)
+    return str;
+  if (type == V_NUMBER)
+    return stringifyNumber(num);
+  ostringstream s;
+  vector<const void *> path;
+  write(s, path);
+  return s.str();
+}
+
+// A variable that could not be proven numeric. Tracks definedness so reads
+// and writes before `create` report the same errors as the interpreter.
+struct Var {
+  const char *name;
+  Value val;
+  bool defined = false;
+
+  explicit Var(const char *n) : name(n) {}
+
+  void define(Value v) {
+    val = v;
+    defined = true;
+  }
+  void assign(Value v) {
+    if (defined)
+      val = v;
+    else
+      cerr << "Error: variable " << name << " not defined." << endl;
+  }
+  const Value &get() const {
+    static const Value zero(0.0);
+    if (defined)
+      return val;
+    cerr << "Error: variable " << name << " not defined." << endl;
+    return zero;
+  }
+};
+
+inline void print(const Value &v) {
+  vector<const void *> path;
+  v.write(cout, path);
+  cout << '\n';
+}
+inline void print(double n) { cout << Value::stringifyNumber(n) << '\n'; }
+
+inline Value plus(const Value &l, const Value &r) {
+  if (l.type == Value::V_STRING || r.type == Value::V_STRING)
+    return Value(l.stringify() + r.stringify());
+  return Value(l.num + r.num);
+}
+inline Value equal(const Value &l, const Value &r) {
+  return Value(l.num == r.num && l.str == r.str ? 1 : 0);
+}
+
+// Matches Value::index() in the interpreter.
+inline int64_t listIndex(double index) {
+  if (!(index > -9.2e18 && index < 9.2e18))
+    return -1;
+  return (int64_t)index;
+}
+
+inline Value listAt(const Var &var, double index) {
+  const Value &arr = var.get();
+  int64_t idx = listIndex(index);
+  if (arr.type == Value::V_LIST && idx >= 0 &&
+      (uint64_t)idx < arr.list_val->size())
+    return (*arr.list_val)[idx];
+  return Value(0.0);
+}
+
+// The gap growth past the end may zero-fill is capped as in the
+// interpreter's ListAssignStmt.
+const uint64_t MAX_GROWTH_GAP = 1 << 24;
+
+inline void listSet(const Var &var, double index, Value v) {
+  const Value &arr = var.get();
+  int64_t idx = listIndex(index);
+  if (arr.type == Value::V_LIST && idx >= 0) {
+    if (arr.list_val->size() <= (uint64_t)idx) {
+      if ((uint64_t)idx - arr.list_val->size() > MAX_GROWTH_GAP) {
+        cerr << "Error: index " << idx << " is too far past the end of list "
+             << var.name << "." << endl;
+        return;
+      }
+      arr.list_val->resize(idx + 1);
+    }
+    (*arr.list_val)[idx] = v;
+  }
+}
+
+inline void listAdd(const Var &var, Value v) {
+  const Value &arr = var.get();
+  if (arr.type == Value::V_LIST)
+    arr.list_val->push_back(v);
+}
+
+inline Value propertyGet(const Var &var, const Value &prop) {
+  const Value &obj = var.get();
+  string key = prop.type == Value::V_STRING ? prop.str : to_string(prop.num);
+  if (obj.type == Value::V_OBJECT) {
+    auto it = obj.obj_val->find(key);
+    if (it != obj.obj_val->end())
+      return it->second;
+  }
+  return Value(0.0);
+}
+
+inline void propertySet(const Var &var, const Value &prop, Value v) {
+  const Value &obj = var.get();
+  string key = prop.type == Value::V_STRING ? prop.str : prop.stringify();
+  if (obj.type == Value::V_OBJECT)
+    (*obj.obj_val)[key] = v;
+}
+
+// Element order and identity for sort / contains / index of; see
+// elementLess and sameElement in the interpreter.
+inline int elementRank(const Value &v) {
+  return v.type == Value::V_NUMBER ? 0 : v.type == Value::V_STRING ? 1 : 2;
+}
+inline bool elementLess(const Value &a, const Value &b) {
+  int ra = elementRank(a), rb = elementRank(b);
+  if (ra != rb)
+    return ra < rb;
+  if (a.type == Value::V_STRING)
+    return a.str < b.str;
+  if (a.type != Value::V_NUMBER)
+    return false;
+  if (std::isnan(a.num) || std::isnan(b.num))
+    return !std::isnan(a.num) && std::isnan(b.num);
+  return a.num < b.num;
+}
+inline bool sameElement(const Value &a, const Value &b) {
+  if (a.type != b.type)
+    return false;
+  if (a.type == Value::V_NUMBER)
+    return a.num == b.num;
+  if (a.type == Value::V_STRING)
+    return a.str == b.str;
+  if (a.type == Value::V_LIST)
+    return a.list_val == b.list_val;
+  return a.obj_val == b.obj_val;
+}
+
+inline void listSort(const Var &var) {
+  const Value &arr = var.get();
+  if (arr.type == Value::V_LIST)
+    stable_sort(arr.list_val->begin(), arr.list_val->end(), elementLess);
+}
+
+inline void listSortBy(const Var &var, const Value &prop) {
+  const Value &arr = var.get();
+  if (arr.type != Value::V_LIST)
+    return;
+  string key = prop.type == Value::V_STRING ? prop.str : to_string(prop.num);
+  static const Value zero(0.0);
+  auto keyOf = [&](const Value &v) -> const Value & {
+    if (v.type == Value::V_OBJECT) {
+      auto it = v.obj_val->find(key);
+      if (it != v.obj_val->end())
+        return it->second;
+    }
+    return zero;
+  };
+  stable_sort(arr.list_val->begin(), arr.list_val->end(),
+              [&](const Value &a, const Value &b) {
+                return elementLess(keyOf(a), keyOf(b));
+              });
+}
+
+inline double listFind(const Value &list, const Value &v) {
+  if (list.type != Value::V_LIST)
+    return -1;
+  for (size_t i = 0; i < list.list_val->size(); i++)
+    if (sameElement((*list.list_val)[i], v))
+      return (double)i;
+  return -1;
+}
+
+inline double listSearch(const Value &list, const Value &v) {
+  if (list.type != Value::V_LIST)
+    return -1;
+  auto &items = *list.list_val;
+  auto it = lower_bound(items.begin(), items.end(), v, elementLess);
+  if (it == items.end() || !sameElement(*it, v))
+    return -1;
+  return (double)(it - items.begin());
+}
+
+} // namespace nrt
+
+#endif
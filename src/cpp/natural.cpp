@@ -1,10 +1,33 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <coroutine>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <dirent.h>
+#include <fcntl.h>
 #include <fstream>
+#include <functional>
+#include <iomanip>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 using namespace std;
@@ -54,29 +77,51 @@ enum TokenType {
   AT,
   ADD,
 
+  // Heap snapshots
+  CHECKPOINT,
+
   EOF_TOK
 };
 
 struct Token {
   TokenType type;
   string lexeme;
+  size_t line;
 };
 
+// "times" is the loop keyword after `repeat <count>` and multiplication after
+// any other number or name; `at` is the index the token has in `tokens`.
+static TokenType timesType(const vector<Token> &tokens, size_t at) {
+  if (at > 0 &&
+      (tokens[at - 1].type == NUMBER || tokens[at - 1].type == IDENTIFIER))
+    return at >= 2 && tokens[at - 2].type == REPEAT ? TIMES : TIMES_OP;
+  return TIMES;
+}
+
+// Lexes source[begin, end), which must start and end outside any string
+// literal or comment; line numbers count from firstLine.
 class Lexer {
-  string source;
-  size_t current = 0;
+  const string &source;
+  size_t current;
+  size_t end;
+  size_t line;
 
-  bool isAtEnd() const { return current >= source.length(); }
+  bool isAtEnd() const { return current >= end; }
   char advance() { return source[current++]; }
   char peek() const { return isAtEnd() ? '\0' : source[current]; }
 
 public:
-  Lexer(string src) : source(src) {}
+  Lexer(const string &src, size_t begin = 0, size_t stop = string::npos,
+        size_t firstLine = 1)
+      : source(src), current(begin), end(min(stop, src.size())),
+        line(firstLine) {}
 
   vector<Token> tokenize() {
     vector<Token> tokens;
     while (!isAtEnd()) {
       char c = advance();
+      if (c == '\n')
+        line++;
       if (isspace(c))
         continue;
 
@@ -163,102 +208,321 @@ public:
           type = AT;
         else if (text == "add")
           type = ADD;
+        else if (text == "checkpoint")
+          type = CHECKPOINT;
 
         // Hacky fix for "times" being used as both loop and multiply
-        if (text == "times" && tokens.size() > 0 &&
-            (tokens.back().type == NUMBER ||
-             tokens.back().type == IDENTIFIER)) {
-          if (tokens.size() >= 2 && tokens[tokens.size() - 2].type == REPEAT)
-            type = TIMES;
-          else
-            type = TIMES_OP;
-        }
+        if (type == TIMES)
+          type = timesType(tokens, tokens.size());
 
-        tokens.push_back({type, text});
+        tokens.push_back({type, text, line});
       } else if (isdigit(c)) {
         size_t start = current - 1;
         while (!isAtEnd() && (isdigit(peek()) || peek() == '.'))
           advance();
-        tokens.push_back({NUMBER, source.substr(start, current - start)});
+        tokens.push_back(
+            {NUMBER, source.substr(start, current - start), line});
       } else if (c == '"') {
-        size_t start = current;
-        while (!isAtEnd() && peek() != '"')
-          advance();
-        tokens.push_back({STRING_LIT, source.substr(start, current - start)});
+        size_t start = current, startLine = line;
+        while (!isAtEnd() && peek() != '"') {
+          if (advance() == '\n')
+            line++;
+        }
+        tokens.push_back(
+            {STRING_LIT, source.substr(start, current - start), startLine});
         advance(); // closing quote
       } else if (c == '(') {
-        tokens.push_back({LPAREN, "("});
+        tokens.push_back({LPAREN, "(", line});
       } else if (c == ')') {
-        tokens.push_back({RPAREN, ")"});
+        tokens.push_back({RPAREN, ")", line});
       }
     }
-    tokens.push_back({EOF_TOK, ""});
+    tokens.push_back({EOF_TOK, "", line});
     return tokens;
   }
 };
 
+// --- PARALLEL LEXING ---
+// Large sources are split into chunks at newlines that lie outside string
+// literals, lexed on separate threads and stitched back together. A
+// newline never ends up inside any other token, so each chunk lexes exactly
+// as it would in one pass, except for the look-back in timesType, which is
+// redone across each seam.
+
+static const size_t LEX_CHUNK_BYTES = 1 << 20; // smallest chunk worth a thread
+
+struct LexChunk {
+  size_t begin;
+  size_t line;
+};
+
+// Finds up to `count` chunk starts with a quote-parity scan: a '"' opens or
+// closes a string except inside a note: comment, and a comment starts only
+// where the lexer would start a token. Strings and comments are skipped with
+// memchr, so the scan costs far less than lexing.
+static vector<LexChunk> lexChunks(const string &source, size_t count) {
+  // Character classes as the lexer sees them, in a table so the hot loop
+  // avoids a locale lookup per byte.
+  enum : unsigned char { OTHER, ALPHA, DIGIT, UNDERSCORE };
+  static const auto classes = [] {
+    array<unsigned char, 256> t{};
+    for (int c = 0; c < 256; c++)
+      t[c] = isalpha(c) ? ALPHA : isdigit(c) ? DIGIT : c == '_' ? UNDERSCORE : OTHER;
+    return t;
+  }();
+  auto cls = [&](char c) { return classes[(unsigned char)c]; };
+
+  vector<LexChunk> chunks{{0, 1}};
+  const char *text = source.data();
+  size_t size = source.size(), target = size / count, line = 1, i = 0;
+  auto countLines = [&](size_t from, size_t to) {
+    for (const char *p = text + from;
+         (p = (const char *)memchr(p, '\n', text + to - p)); p++)
+      line++;
+  };
+  while (i < size && chunks.size() < count) {
+    char c = text[i];
+    if (c == '"') {
+      const char *close = (const char *)memchr(text + i + 1, '"', size - i - 1);
+      size_t next = close ? close - text : size;
+      countLines(i + 1, next);
+      i = next + 1;
+    } else if (c == 'n' && source.compare(i, 5, "note:") == 0) {
+      const char *eol = (const char *)memchr(text + i, '\n', size - i);
+      i = eol ? eol - text : size;
+    } else if (cls(c) == ALPHA) {
+      // Words and numbers are skipped whole so an "n" inside one is not
+      // mistaken for the start of a comment.
+      do
+        i++;
+      while (i < size && cls(text[i]) != OTHER);
+    } else if (cls(c) == DIGIT) {
+      do
+        i++;
+      while (i < size && (cls(text[i]) == DIGIT || text[i] == '.'));
+    } else {
+      if (c == '\n') {
+        line++;
+        if (i + 1 >= chunks.size() * target && i + 1 < size)
+          chunks.push_back({i + 1, line});
+      }
+      i++;
+    }
+  }
+  return chunks;
+}
+
+// Tokenizes the whole source, in parallel when it is large enough: threads
+// is the most chunks to use, 0 for one per core.
+static vector<Token> tokenizeSource(const string &source, size_t threads,
+                                    size_t *chunksUsed = nullptr) {
+  if (threads == 0)
+    threads = max(1u, thread::hardware_concurrency());
+  size_t count = min(threads, source.size() / LEX_CHUNK_BYTES);
+  vector<LexChunk> chunks =
+      count > 1 ? lexChunks(source, count) : vector<LexChunk>{{0, 1}};
+  if (chunksUsed)
+    *chunksUsed = chunks.size();
+  if (chunks.size() == 1)
+    return Lexer(source).tokenize();
+
+  vector<vector<Token>> parts(chunks.size());
+  vector<thread> workers;
+  for (size_t c = 0; c < chunks.size(); c++) {
+    size_t stop = c + 1 < chunks.size() ? chunks[c + 1].begin : source.size();
+    workers.emplace_back([&, c, stop]() {
+      parts[c] = Lexer(source, chunks[c].begin, stop, chunks[c].line).tokenize();
+    });
+  }
+  for (auto &t : workers)
+    t.join();
+
+  // Stitch: each chunk moves its tokens into place on its own thread.
+  vector<size_t> seams(parts.size() + 1, 0);
+  for (size_t c = 0; c < parts.size(); c++)
+    seams[c + 1] = seams[c] + parts[c].size() - 1; // less the chunk's EOF
+  vector<Token> tokens(seams.back() + 1);
+  tokens.back() = move(parts.back().back());
+  workers.clear();
+  for (size_t c = 0; c < parts.size(); c++) {
+    workers.emplace_back([&, c]() {
+      move(parts[c].begin(), parts[c].end() - 1, tokens.begin() + seams[c]);
+      vector<Token>().swap(parts[c]);
+    });
+  }
+  for (auto &t : workers)
+    t.join();
+
+  // Only the first two tokens of a chunk look back past its start.
+  for (size_t c = 1; c < parts.size(); c++)
+    for (size_t i = seams[c]; i < seams[c] + 2 && i < seams.back(); i++)
+      if (tokens[i].lexeme == "times")
+        tokens[i].type = timesType(tokens, i);
+  return tokens;
+}
+
 // --- AST & INTERPRETER ---
 
+// Limits applied when displaying lists and objects; zero means unlimited.
+struct DisplayLimits {
+  size_t maxElements = 0; // entries shown per list/object
+  size_t maxDepth = 0;    // nesting levels shown
+};
+
+// Immutable string storage shared by every copy, so copying a string Value
+// is a pointer copy. The hash is computed once, when the text is created.
+// Interned strings (literals, identifiers and property names from the
+// source) have a single buffer per distinct text, so two of them are equal
+// exactly when they share it. The empty string has no buffer.
+class Str {
+  struct Data {
+    string text;
+    size_t hash;
+    bool interned;
+  };
+  shared_ptr<const Data> data;
+
+  static size_t hashOf(const string &s) { return std::hash<string>()(s); }
+
+  // The intern table holds weak references: an entry lasts while some Str
+  // uses it, and the last one to go removes it, so a long --batch run only
+  // keeps the text of the programs still loaded. Sharded by hash so parsers
+  // on different threads rarely share a lock.
+  static const size_t INTERN_SHARDS = 16;
+  struct InternShard {
+    mutex lock;
+    unordered_map<string, weak_ptr<const Data>> table;
+  };
+  static InternShard &shardFor(size_t hash) {
+    // Never destroyed: Strs in static storage may be released after it.
+    static InternShard *shards = new InternShard[INTERN_SHARDS];
+    return shards[hash % INTERN_SHARDS];
+  }
+  static void release(const Data *d) {
+    InternShard &shard = shardFor(d->hash);
+    {
+      lock_guard<mutex> guard(shard.lock);
+      // A concurrent intern() may already have replaced the expired entry.
+      auto it = shard.table.find(d->text);
+      if (it != shard.table.end() && it->second.expired())
+        shard.table.erase(it);
+    }
+    delete d;
+  }
+
+public:
+  Str() {}
+  Str(string s) {
+    if (!s.empty()) {
+      size_t h = hashOf(s);
+      data = make_shared<const Data>(Data{move(s), h, false});
+    }
+  }
+  Str(const char *s) : Str(string(s)) {}
+
+  // The shared copy of `s`.
+  static Str intern(const string &s) {
+    if (s.empty())
+      return Str();
+    size_t h = hashOf(s);
+    InternShard &shard = shardFor(h);
+    lock_guard<mutex> guard(shard.lock);
+    weak_ptr<const Data> &entry = shard.table[s];
+    Str str;
+    str.data = entry.lock();
+    if (!str.data) {
+      str.data = shared_ptr<const Data>(new Data{s, h, true}, release);
+      entry = str.data;
+    }
+    return str;
+  }
+
+  const string &text() const {
+    static const string empty;
+    return data ? data->text : empty;
+  }
+  operator const string &() const { return text(); }
+  bool empty() const { return !data; }
+  size_t length() const { return data ? data->text.size() : 0; }
+  size_t hash() const { return data ? data->hash : 0; }
+
+  bool operator==(const Str &other) const {
+    if (data == other.data)
+      return true;
+    // Only nonempty strings have a buffer, and interned ones are unique.
+    if (!data || !other.data || (data->interned && other.data->interned))
+      return false;
+    return data->hash == other.data->hash && data->text == other.data->text;
+  }
+  bool operator!=(const Str &other) const { return !(*this == other); }
+  bool operator<(const Str &other) const { return text() < other.text(); }
+};
+
+inline ostream &operator<<(ostream &out, const Str &s) { return out << s.text(); }
+
+struct StrHash {
+  size_t operator()(const Str &s) const { return s.hash(); }
+};
+
+struct Value;
+
+// Object properties, and the variables of an Environment.
+typedef unordered_map<Str, Value, StrHash> ValueMap;
+
+struct ListData;
+
 struct Value {
   enum ValueType { V_NUMBER, V_STRING, V_LIST, V_OBJECT } type;
   double num;
-  string str;
-  shared_ptr<vector<Value>> list_val;
-  shared_ptr<unordered_map<string, Value>> obj_val;
+  Str str;
+  shared_ptr<ListData> list_val;
+  shared_ptr<ValueMap> obj_val;
+  // Integer tier: numbers from integer literals and integer arithmetic are
+  // exact in inum; num always mirrors it for code that only reads doubles.
+  bool isInt = false;
+  int64_t inum = 0;
 
   Value() : type(V_NUMBER), num(0) {}
   Value(double n) : type(V_NUMBER), num(n) {}
-  Value(string s) : type(V_STRING), str(s) {}
+  Value(Str s) : type(V_STRING), num(0), str(s) {}
 
-  static Value createList() {
+  static Value fromInt(int64_t i) {
     Value v;
-    v.type = V_LIST;
-    v.list_val = make_shared<vector<Value>>();
+    v.num = (double)i;
+    v.isInt = true;
+    v.inum = i;
     return v;
   }
 
+  // List index for this value; doubles truncate toward zero, and anything
+  // outside the int64 range maps to -1 (out of bounds).
+  int64_t index() const {
+    if (isInt)
+      return inum;
+    if (!(num > -9.2e18 && num < 9.2e18))
+      return -1;
+    return (int64_t)num;
+  }
+
+  static Value createList();
+
   static Value createObject() {
     Value v;
     v.type = V_OBJECT;
-    v.obj_val = make_shared<unordered_map<string, Value>>();
+    v.obj_val = make_shared<ValueMap>();
     return v;
   }
 
-  string stringify() const {
-    if (type == V_STRING)
-      return str;
-    if (type == V_NUMBER) {
-      string s = to_string(num);
-      s.erase(s.find_last_not_of('0') + 1, std::string::npos);
-      if (s.back() == '.')
-        s.pop_back();
-      return s;
-    }
-    if (type == V_LIST) {
-      string s = "[";
-      for (size_t i = 0; i < list_val->size(); i++) {
-        s += list_val->at(i).stringify();
-        if (i < list_val->size() - 1)
-          s += ", ";
-      }
-      s += "]";
-      return s;
-    }
-    if (type == V_OBJECT) {
-      string s = "{";
-      bool first = true;
-      for (auto const &pair : *obj_val) {
-        if (!first)
-          s += ", ";
-        s += pair.first + ": " + pair.second.stringify();
-        first = false;
-      }
-      return s + "}";
-    }
-    return "undefined";
+  static string formatNumber(double n) {
+    string s = to_string(n);
+    s.erase(s.find_last_not_of('0') + 1, std::string::npos);
+    if (s.back() == '.')
+      s.pop_back();
+    return s;
   }
 
-  void print() { cout << stringify() << endl; }
+  string stringify() const;
+  void print(ostream &out, const DisplayLimits &limits = DisplayLimits()) const;
 
   bool isTruthy() {
     if (type == V_STRING)
@@ -269,471 +533,4811 @@ struct Value {
   }
 };
 
-class Environment {
-  unordered_map<string, Value> values;
+// --- LIST SORTING & SEARCH ---
+// Element order and identity used by `sort`, `contains` and `index of`.
+// Numbers compare by value (exactly for integers) and come before strings,
+// which come before lists and objects. Lists and objects are only the same
+// element as themselves and never order against each other, so sorting
+// leaves them where they were relative to one another.
 
-public:
-  void define(string name, Value val) { values[name] = val; }
-  void assign(string name, Value val) {
-    if (values.find(name) != values.end())
-      values[name] = val;
-    else
-      cerr << "Error: variable " << name << " not defined." << endl;
-  }
-  Value get(string name) {
-    if (values.find(name) != values.end())
-      return values[name];
-    cerr << "Error: variable " << name << " not defined." << endl;
-    return Value(0);
+static int elementRank(const Value &v) {
+  switch (v.type) {
+  case Value::V_NUMBER:
+    return 0;
+  case Value::V_STRING:
+    return 1;
+  default:
+    return 2;
   }
-};
+}
 
-class Expr {
-public:
-  virtual Value evaluate(Environment &env) = 0;
-};
+static bool elementLess(const Value &a, const Value &b) {
+  int ra = elementRank(a), rb = elementRank(b);
+  if (ra != rb)
+    return ra < rb;
+  if (a.type == Value::V_STRING)
+    return a.str < b.str;
+  if (a.type != Value::V_NUMBER)
+    return false;
+  if (a.isInt && b.isInt)
+    return a.inum < b.inum;
+  // NaN sorts after every other number so the order stays strict-weak.
+  if (isnan(a.num) || isnan(b.num))
+    return !isnan(a.num) && isnan(b.num);
+  return a.num < b.num;
+}
 
-class LiteralExpr : public Expr {
-  Value val;
+static bool sameElement(const Value &a, const Value &b) {
+  if (a.type != b.type)
+    return false;
+  switch (a.type) {
+  case Value::V_NUMBER:
+    return a.isInt && b.isInt ? a.inum == b.inum : a.num == b.num;
+  case Value::V_STRING:
+    return a.str == b.str;
+  case Value::V_LIST:
+    return a.list_val == b.list_val;
+  default:
+    return a.obj_val == b.obj_val;
+  }
+}
 
-public:
-  LiteralExpr(Value v) : val(v) {}
-  Value evaluate(Environment &env) override { return val; }
-};
+static size_t elementHash(const Value &v) {
+  switch (v.type) {
+  case Value::V_NUMBER:
+    // Integers and doubles with the same value must land together.
+    return hash<double>()(v.num);
+  case Value::V_STRING:
+    return v.str.hash() ^ 0x9e3779b97f4a7c15ull;
+  case Value::V_LIST:
+    return hash<const void *>()(v.list_val.get());
+  default:
+    return hash<const void *>()(v.obj_val.get());
+  }
+}
 
-class VariableExpr : public Expr {
-  string name;
+// Open-addressing table from element value to the first position holding
+// it. Slots store positions into the list rather than copies of elements.
+struct ListIndex {
+  vector<size_t> slots; // position + 1; 0 is empty
+  size_t count = 0;
 
-public:
-  VariableExpr(string n) : name(n) {}
-  Value evaluate(Environment &env) override { return env.get(name); }
-};
+  explicit ListIndex(size_t elements) {
+    size_t capacity = 16;
+    while (capacity < elements * 2)
+      capacity *= 2;
+    slots.assign(capacity, 0);
+  }
 
-// Access List elements
-class ListAccessExpr : public Expr {
-  string name;
-  shared_ptr<Expr> indexExpr;
+  bool full() const { return (count + 1) * 2 > slots.size(); }
 
-public:
-  ListAccessExpr(string n, shared_ptr<Expr> idx) : name(n), indexExpr(idx) {}
-  Value evaluate(Environment &env) override {
-    Value arr = env.get(name);
-    int idx = (int)indexExpr->evaluate(env).num;
-    if (arr.type == Value::V_LIST && idx >= 0 && idx < arr.list_val->size()) {
-      return arr.list_val->at(idx);
+  // Slot holding `v`, or the empty slot where it would go.
+  size_t probe(const vector<Value> &list, const Value &v) const {
+    size_t mask = slots.size() - 1;
+    size_t i = elementHash(v) & mask;
+    while (slots[i] != 0 && !sameElement(list[slots[i] - 1], v))
+      i = (i + 1) & mask;
+    return i;
+  }
+
+  // Records `position` unless an earlier position holds the same value.
+  void add(const vector<Value> &list, size_t position) {
+    size_t i = probe(list, list[position]);
+    if (slots[i] == 0) {
+      slots[i] = position + 1;
+      count++;
     }
-    return Value(0);
   }
 };
 
-// Access Object elements
-class PropertyAccessExpr : public Expr {
-  shared_ptr<Expr> propExpr;
-  string objName;
+// List storage: the elements plus a hash index for `contains` and `index
+// of`. The index is built by the first lookup; appends keep it current and
+// any other change to the elements drops it. Lists shared between tasks
+// are not synchronised, for lookups as for writes.
+struct ListData : vector<Value> {
+  // `set <list> at <index>` past the end fills the gap with zeros; an index
+  // more than this far past the end reports an error instead of allocating
+  // the gap. Filling in order never leaves a gap, so lists grow without
+  // limit that way.
+  static const uint64_t MAX_GROWTH_GAP = 1 << 24;
 
-public:
-  PropertyAccessExpr(shared_ptr<Expr> prop, string obj)
-      : propExpr(prop), objName(obj) {}
-  Value evaluate(Environment &env) override {
-    Value obj = env.get(objName);
-    Value prop = propExpr->evaluate(env);
-    string key = prop.type == Value::V_STRING ? prop.str : to_string(prop.num);
+  unique_ptr<ListIndex> index;
 
-    if (obj.type == Value::V_OBJECT &&
-        obj.obj_val->find(key) != obj.obj_val->end()) {
-      return obj.obj_val->at(key);
+  void changed() { index.reset(); }
+
+  void appended() {
+    if (!index)
+      return;
+    if (index->full())
+      index.reset();
+    else
+      index->add(*this, size() - 1);
+  }
+
+  // Position of the first element equal to `v`, or -1.
+  int64_t find(const Value &v) {
+    // Short lists are cheaper to scan than to index.
+    if (size() < 8) {
+      for (size_t i = 0; i < size(); i++)
+        if (sameElement((*this)[i], v))
+          return i;
+      return -1;
     }
-    return Value(0);
+    if (!index) {
+      index = make_unique<ListIndex>(size());
+      for (size_t i = 0; i < size(); i++)
+        index->add(*this, i);
+    }
+    size_t slot = index->slots[index->probe(*this, v)];
+    return slot == 0 ? -1 : (int64_t)slot - 1;
   }
-};
 
-class BinaryExpr : public Expr {
-  shared_ptr<Expr> left;
-  TokenType op;
-  shared_ptr<Expr> right;
+  // Binary search for `v` in a list already in `sort` order, or -1.
+  int64_t search(const Value &v) const {
+    auto it = lower_bound(begin(), end(), v, elementLess);
+    if (it == end() || !sameElement(*it, v))
+      return -1;
+    return it - begin();
+  }
 
-public:
-  BinaryExpr(shared_ptr<Expr> l, TokenType o, shared_ptr<Expr> r)
-      : left(l), op(o), right(r) {}
-  Value evaluate(Environment &env) override {
-    Value l = left->evaluate(env);
-    Value r = right->evaluate(env);
+  void sort() {
+    stable_sort(begin(), end(), elementLess);
+    changed();
+  }
 
-    if (op == PLUS) {
-      if (l.type == Value::V_STRING || r.type == Value::V_STRING) {
-        return Value(l.stringify() + r.stringify());
+  // Stable sort by the `key` property of each element; elements that are
+  // not objects or lack the property sort as 0.
+  void sortBy(const Str &key) {
+    static const Value zero(0);
+    vector<const Value *> keys;
+    keys.reserve(size());
+    for (auto &element : *this) {
+      const Value *k = &zero;
+      if (element.type == Value::V_OBJECT) {
+        auto it = element.obj_val->find(key);
+        if (it != element.obj_val->end())
+          k = &it->second;
       }
-      return Value(l.num + r.num);
+      keys.push_back(k);
     }
-    if (op == MINUS)
-      return Value(l.num - r.num);
-    if (op == TIMES_OP)
-      return Value(l.num * r.num);
-    if (op == EQUAL)
-      return Value(l.num == r.num && l.str == r.str ? 1 : 0);
-    if (op == LESS)
-      return Value(l.num < r.num ? 1 : 0);
-
-    return Value(0);
+    vector<size_t> order(size());
+    for (size_t i = 0; i < order.size(); i++)
+      order[i] = i;
+    stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+      return elementLess(*keys[a], *keys[b]);
+    });
+    vector<Value> sorted;
+    sorted.reserve(size());
+    for (size_t i : order)
+      sorted.push_back(move((*this)[i]));
+    swap(sorted);
+    changed();
   }
 };
 
-class Stmt {
-public:
-  virtual void execute(Environment &env) = 0;
-};
+Value Value::createList() {
+  Value v;
+  v.type = V_LIST;
+  v.list_val = make_shared<ListData>();
+  return v;
+}
 
-class PrintStmt : public Stmt {
-  shared_ptr<Expr> expr;
+// Streams the textual form of a value straight to an output stream instead
+// of building it up in temporary strings. Lists and objects on the current
+// path are tracked, so a self-reference prints as [...] or {...} rather than
+// recursing forever; the same markers stand in for anything past maxDepth.
+class ValueWriter {
+  ostream &out;
+  DisplayLimits limits;
+  vector<const void *> path;
 
-public:
-  PrintStmt(shared_ptr<Expr> e) : expr(e) {}
-  void execute(Environment &env) override { expr->evaluate(env).print(); }
-};
+  bool enter(const void *aggregate) {
+    if (limits.maxDepth && path.size() >= limits.maxDepth)
+      return false;
+    for (const void *p : path)
+      if (p == aggregate)
+        return false;
+    path.push_back(aggregate);
+    return true;
+  }
 
-class VarDeclStmt : public Stmt {
-  string name;
-  shared_ptr<Expr> initializer;
+  // Writes the separator before entry i; false once the limit is reached.
+  bool next(size_t i) {
+    if (i > 0)
+      out << ", ";
+    if (limits.maxElements && i >= limits.maxElements) {
+      out << "...";
+      return false;
+    }
+    return true;
+  }
 
 public:
-  VarDeclStmt(string n, shared_ptr<Expr> init) : name(n), initializer(init) {}
-  void execute(Environment &env) override {
-    env.define(name, initializer->evaluate(env));
+  ValueWriter(ostream &o, DisplayLimits l = DisplayLimits())
+      : out(o), limits(l) {}
+
+  void write(const Value &v) {
+    switch (v.type) {
+    case Value::V_STRING:
+      out << v.str;
+      break;
+    case Value::V_NUMBER:
+      if (v.isInt)
+        out << v.inum;
+      else
+        out << Value::formatNumber(v.num);
+      break;
+    case Value::V_LIST:
+      writeList(*v.list_val);
+      break;
+    case Value::V_OBJECT:
+      writeObject(*v.obj_val);
+      break;
+    }
   }
-};
 
-// Object/List creation fake exprs (helper nodes)
-class ObjCreateExpr : public Expr {
-public:
-  Value evaluate(Environment &env) override { return Value::createObject(); }
-};
-class ListCreateExpr : public Expr {
-public:
-  Value evaluate(Environment &env) override { return Value::createList(); }
+  void writeList(const vector<Value> &list) {
+    if (!enter(&list)) {
+      out << "[...]";
+      return;
+    }
+    out << '[';
+    for (size_t i = 0; i < list.size() && next(i); i++)
+      write(list[i]);
+    out << ']';
+    path.pop_back();
+  }
+
+  void writeObject(const ValueMap &obj) {
+    if (!enter(&obj)) {
+      out << "{...}";
+      return;
+    }
+    out << '{';
+    size_t i = 0;
+    for (auto const &pair : obj) {
+      if (!next(i++))
+        break;
+      out << pair.first << ": ";
+      write(pair.second);
+    }
+    out << '}';
+    path.pop_back();
+  }
 };
 
-class AssignStmt : public Stmt {
-  string name;
-  shared_ptr<Expr> value;
+string Value::stringify() const {
+  if (type == V_STRING)
+    return str;
+  if (type == V_NUMBER)
+    return isInt ? to_string(inum) : formatNumber(num);
+  ostringstream s;
+  ValueWriter(s).write(*this);
+  return s.str();
+}
 
-public:
-  AssignStmt(string n, shared_ptr<Expr> v) : name(n), value(v) {}
-  void execute(Environment &env) override {
-    env.assign(name, value->evaluate(env));
-  }
+void Value::print(ostream &out, const DisplayLimits &limits) const {
+  ValueWriter(out, limits).write(*this);
+  out << endl;
+}
+
+// Operand of arithmetic: an exact integer while every input was an integer
+// and nothing overflowed, otherwise a double. Division always yields a double.
+struct Num {
+  bool isInt;
+  int64_t i;
+  double d;
+
+  explicit Num(int64_t v) : isInt(true), i(v), d((double)v) {}
+  explicit Num(double v) : isInt(false), i(0), d(v) {}
+  static Num of(const Value &v) { return v.isInt ? Num(v.inum) : Num(v.num); }
+
+  Value toValue() const { return isInt ? Value::fromInt(i) : Value(d); }
+  bool isTruthy() const { return isInt ? i != 0 : d != 0; }
 };
 
-class ListAssignStmt : public Stmt {
-  string name;
-  shared_ptr<Expr> indexExpr;
-  shared_ptr<Expr> value;
+inline Num numAdd(Num l, Num r) {
+  int64_t out;
+  if (l.isInt && r.isInt && !__builtin_add_overflow(l.i, r.i, &out))
+    return Num(out);
+  return Num(l.d + r.d);
+}
+inline Num numSub(Num l, Num r) {
+  int64_t out;
+  if (l.isInt && r.isInt && !__builtin_sub_overflow(l.i, r.i, &out))
+    return Num(out);
+  return Num(l.d - r.d);
+}
+inline Num numMul(Num l, Num r) {
+  int64_t out;
+  if (l.isInt && r.isInt && !__builtin_mul_overflow(l.i, r.i, &out))
+    return Num(out);
+  return Num(l.d * r.d);
+}
+inline Num numDiv(Num l, Num r) { return Num(l.d / r.d); }
+inline bool numEqual(Num l, Num r) {
+  return l.isInt && r.isInt ? l.i == r.i : l.d == r.d;
+}
+inline bool numLess(Num l, Num r) {
+  return l.isInt && r.isInt ? l.i < r.i : l.d < r.d;
+}
 
-public:
-  ListAssignStmt(string n, shared_ptr<Expr> idx, shared_ptr<Expr> val)
-      : name(n), indexExpr(idx), value(val) {}
-  void execute(Environment &env) override {
-    Value arr = env.get(name);
-    int idx = (int)indexExpr->evaluate(env).num;
-    if (arr.type == Value::V_LIST) {
-      while (arr.list_val->size() <= idx)
-        arr.list_val->push_back(Value(0));
-      arr.list_val->at(idx) = value->evaluate(env);
-    }
+struct Task;
+
+// Lists and objects a run allocated, and scratch aggregates it cleared for
+// reuse instead (see ScratchDeclStmt); reported by --stats. Each Environment
+// counts its own; task and batch totals are summed when they finish.
+struct AllocationCounters {
+  uint64_t lists = 0;
+  uint64_t objects = 0;
+  uint64_t reused = 0;
+
+  AllocationCounters &operator+=(const AllocationCounters &other) {
+    lists += other.lists;
+    objects += other.objects;
+    reused += other.reused;
+    return *this;
+  }
+  void report(ostream &out) const {
+    out << "Allocations: " << lists << " list(s), " << objects
+        << " object(s); " << reused << " scratch aggregate(s) reused\n";
   }
 };
 
-class PropertyAssignStmt : public Stmt {
-  string name;
-  shared_ptr<Expr> propExpr;
-  shared_ptr<Expr> value;
+// Copies the lists and objects a set of values reaches, so tasks never
+// share mutable storage (lists and objects have no locks). Aggregates
+// reached more than once, including through cycles, are copied once and
+// stay shared within the copy. Works from a queue rather than recursing,
+// so deeply nested data cannot overflow the stack. Copied objects keep
+// their table layout and so display their properties in the same order.
+class AggregateCopier {
+  unordered_map<const void *, Value> copies; // original -> copy
+  vector<pair<Value, Value>> pending;        // copies still to fill
+  AllocationCounters &allocations;
 
 public:
-  PropertyAssignStmt(string n, shared_ptr<Expr> p, shared_ptr<Expr> v)
-      : name(n), propExpr(p), value(v) {}
-  void execute(Environment &env) override {
-    Value obj = env.get(name);
-    Value prop = propExpr->evaluate(env);
-    string key = prop.type == Value::V_STRING ? prop.str : prop.stringify();
+  explicit AggregateCopier(AllocationCounters &a) : allocations(a) {}
 
-    if (obj.type == Value::V_OBJECT) {
-      (*obj.obj_val)[key] = value->evaluate(env);
+  // The copy of `v`; its elements are filled in by finish().
+  Value copy(const Value &v) {
+    if (v.type != Value::V_LIST && v.type != Value::V_OBJECT)
+      return v;
+    const void *key = v.type == Value::V_LIST ? (const void *)v.list_val.get()
+                                              : (const void *)v.obj_val.get();
+    auto it = copies.find(key);
+    if (it != copies.end())
+      return it->second;
+    Value c;
+    if (v.type == Value::V_LIST) {
+      c = Value::createList();
+      allocations.lists++;
+    } else {
+      c = Value::createObject();
+      allocations.objects++;
     }
+    copies.emplace(key, c);
+    pending.push_back({v, c});
+    return c;
   }
-};
 
-class AddToListStmt : public Stmt {
-  string name;
-  shared_ptr<Expr> value;
-
-public:
-  AddToListStmt(string n, shared_ptr<Expr> v) : name(n), value(v) {}
-  void execute(Environment &env) override {
-    Value arr = env.get(name);
-    if (arr.type == Value::V_LIST) {
-      arr.list_val->push_back(value->evaluate(env));
+  void finish() {
+    while (!pending.empty()) {
+      auto [original, c] = move(pending.back());
+      pending.pop_back();
+      if (c.type == Value::V_LIST) {
+        c.list_val->assign(original.list_val->begin(),
+                           original.list_val->end());
+        for (auto &element : *c.list_val)
+          element = copy(element);
+      } else {
+        *c.obj_val = *original.obj_val;
+        for (auto &property : *c.obj_val)
+          property.second = copy(property.second);
+      }
     }
   }
 };
 
-class IfStmt : public Stmt {
-  shared_ptr<Expr> condition;
-  vector<shared_ptr<Stmt>> thenBranch;
-  vector<shared_ptr<Stmt>> elseBranch;
+// All state of one running program. Output goes to the sinks it was built
+// with rather than the process-wide streams, so independent interpreters can
+// share a process (see --batch).
+class Environment {
+  ValueMap values;
+
+  void undefined(const Str &name) {
+    errors++;
+    ostringstream message;
+    message << "Error: variable " << name << " not defined." << endl;
+    write(err, message.str());
+  }
 
 public:
-  IfStmt(shared_ptr<Expr> cond, vector<shared_ptr<Stmt>> tb,
-         vector<shared_ptr<Stmt>> eb)
-      : condition(cond), thenBranch(tb), elseBranch(eb) {}
+  ostream &out;
+  ostream &err;
+  size_t errors = 0;
+  AllocationCounters allocations;
+  DisplayLimits display;
+  // Set while running under the task scheduler: the task this environment
+  // belongs to, and the lock serialising output when tasks run on several
+  // threads.
+  Task *task = nullptr;
+  mutex *outputLock = nullptr;
 
-  void execute(Environment &env) override {
-    if (condition->evaluate(env).isTruthy()) {
-      for (auto &stmt : thenBranch)
-        stmt->execute(env);
+  void write(ostream &stream, const string &text) {
+    if (outputLock) {
+      lock_guard<mutex> guard(*outputLock);
+      stream << text << flush;
     } else {
-      for (auto &stmt : elseBranch)
-        stmt->execute(env);
+      stream << text;
     }
   }
-};
 
-class WhileStmt : public Stmt {
-  shared_ptr<Expr> condition;
-  vector<shared_ptr<Stmt>> body;
+  Environment(ostream &o, ostream &e) : out(o), err(e) {}
 
-public:
-  WhileStmt(shared_ptr<Expr> cond, vector<shared_ptr<Stmt>> b)
-      : condition(cond), body(b) {}
-  void execute(Environment &env) override {
-    while (condition->evaluate(env).isTruthy()) {
-      for (auto &stmt : body)
-        stmt->execute(env);
-    }
+  // Names are interned by the nodes that hold them, so lookups compare
+  // pointers and reuse the precomputed hash.
+  void define(const Str &name, Value val) { values[name] = val; }
+  void assign(const Str &name, Value val) {
+    auto it = values.find(name);
+    if (it != values.end())
+      it->second = val;
+    else
+      undefined(name);
+  }
+  const ValueMap &variables() const { return values; }
+  // Replaces every list and object the variables reach with a private copy.
+  void isolate() {
+    AggregateCopier copier(allocations);
+    for (auto &pair : values)
+      pair.second = copier.copy(pair.second);
+    copier.finish();
+  }
+  Value get(const Str &name) {
+    auto it = values.find(name);
+    if (it != values.end())
+      return it->second;
+    undefined(name);
+    return Value(0);
+  }
+  // Null if the variable is undefined; reports nothing.
+  const Value *find(const Str &name) const {
+    auto it = values.find(name);
+    return it == values.end() ? nullptr : &it->second;
+  }
+  Value *find(const Str &name) {
+    auto it = values.find(name);
+    return it == values.end() ? nullptr : &it->second;
+  }
+  // Numeric read for specialised nodes; avoids copying the whole Value.
+  Num getNum(const Str &name) {
+    auto it = values.find(name);
+    if (it != values.end())
+      return Num::of(it->second);
+    undefined(name);
+    return Num(0.0);
   }
 };
 
-class Parser {
-  vector<Token> tokens;
-  int current = 0;
+// --- STATIC TYPE INFERENCE ---
+// A flow-sensitive pass over the parsed program that tracks which type every
+// variable holds at each point. Nodes whose operand types are proven get
+// swapped for specialised variants that skip runtime type dispatch; anything
+// unproven keeps the generic node.
 
-  Token peek() { return tokens[current]; }
-  Token previous() { return tokens[current - 1]; }
-  bool isAtEnd() { return peek().type == EOF_TOK; }
-  Token advance() {
+enum StaticType { T_UNKNOWN, T_NUMBER, T_STRING, T_LIST, T_OBJECT, T_UNDEFINED };
+
+class Expr;
+
+// Whole-program facts gathered alongside the flow-sensitive state, shared by
+// every copy of a scope. The C++ backend uses them to decide which variables
+// can live in plain doubles.
+struct TypeSummary {
+  // Join of every type a variable is created or set with.
+  unordered_map<string, StaticType> assigned;
+  // Variables that may be touched while undefined, or are used as a list or
+  // object target, and so need the generic representation.
+  unordered_set<string> generic;
+
+  void record(const string &name, StaticType t) {
+    auto it = assigned.find(name);
+    if (it == assigned.end())
+      assigned[name] = t;
+    else if (it->second != t)
+      it->second = T_UNKNOWN;
+  }
+
+  bool isNumber(const string &name) const {
+    auto it = assigned.find(name);
+    return it != assigned.end() && it->second == T_NUMBER &&
+           generic.find(name) == generic.end();
+  }
+};
+
+struct TypeScope {
+  // Missing entries and T_UNDEFINED both mean "may not be defined yet".
+  unordered_map<string, StaticType> vars;
+  bool rewriting = true;
+  shared_ptr<TypeSummary> summary = make_shared<TypeSummary>();
+
+  StaticType lookup(const string &name) {
+    auto it = vars.find(name);
+    if (it == vars.end() || it->second == T_UNDEFINED) {
+      summary->generic.insert(name);
+      return T_UNKNOWN;
+    }
+    return it->second;
+  }
+
+  void define(const string &name, StaticType t) {
+    vars[name] = t;
+    summary->record(name, t);
+  }
+
+  // Assigning to an undefined variable is a runtime no-op, so only variables
+  // that are definitely defined take on the new type.
+  void assign(const string &name, StaticType t) {
+    auto it = vars.find(name);
+    if (it != vars.end() && it->second != T_UNDEFINED) {
+      it->second = t;
+      summary->record(name, t);
+    } else {
+      summary->generic.insert(name);
+    }
+  }
+
+  // Marks a variable used as the target of a list or object operation.
+  void aggregate(const string &name) {
+    lookup(name);
+    summary->generic.insert(name);
+  }
+
+  // Merges the state of another control-flow path into this one.
+  void join(const TypeScope &other) {
+    for (auto &pair : vars) {
+      auto it = other.vars.find(pair.first);
+      if (it == other.vars.end() || it->second == T_UNDEFINED)
+        pair.second = T_UNDEFINED;
+      else if (it->second != pair.second && pair.second != T_UNDEFINED)
+        pair.second = T_UNKNOWN;
+    }
+    for (auto const &pair : other.vars)
+      if (vars.find(pair.first) == vars.end())
+        vars[pair.first] = T_UNDEFINED;
+  }
+
+  bool operator==(const TypeScope &other) const { return vars == other.vars; }
+
+  // Infers the type of an expression and, when rewriting, replaces it in
+  // place with its specialised form.
+  StaticType infer(shared_ptr<Expr> &expr);
+};
+
+// --- C++ CODE GENERATION ---
+// Collects the body of the generated main() for --emit-cpp. Expressions
+// return C++ source fragments; statements append lines.
+
+static string cppNumber(double n) {
+  ostringstream out;
+  out << setprecision(17) << n;
+  string s = out.str();
+  if (s.find_first_of(".en") == string::npos)
+    s += ".0";
+  return s;
+}
+
+static string cppString(const string &str) {
+  string s = "\"";
+  for (char c : str) {
+    if (c == '"' || c == '\\')
+      s += '\\', s += c;
+    else if (c == '\n')
+      s += "\\n";
+    else if (c == '\r')
+      s += "\\r";
+    else if (c == '\t')
+      s += "\\t";
+    else
+      s += c;
+  }
+  return s + "\"";
+}
+
+class CppEmitter {
+  const TypeSummary &types;
+  ostringstream body;
+  int depth = 1;
+  vector<string> names;
+  unordered_set<string> seen;
+  int temps = 0;
+  vector<string> errors;
+
+public:
+  CppEmitter(const TypeSummary &t) : types(t) {}
+
+  // Records a construct the runtime has no equivalent for; emitCpp then
+  // reports it and writes nothing.
+  void unsupported(const string &what, uint32_t line) {
+    errors.push_back("Error: " + what + " are not supported by --emit-cpp "
+                     "(line " + to_string(line) + ").");
+  }
+  const vector<string> &failures() const { return errors; }
+
+  bool isNumber(const string &name) const { return types.isNumber(name); }
+
+  string temp(const string &prefix) {
+    return prefix + "_" + to_string(temps++);
+  }
+
+  string var(const string &name) {
+    if (seen.insert(name).second)
+      names.push_back(name);
+    return "v_" + name;
+  }
+
+  void line(const string &code) {
+    body << string(depth * 2, ' ') << code << "\n";
+  }
+  void open(const string &code) {
+    line(code);
+    depth++;
+  }
+  void close(const string &code) {
+    depth--;
+    line(code);
+  }
+  void reopen(const string &code) {
+    close(code);
+    depth++;
+  }
+
+  string finish() const {
+    ostringstream out;
+    out << "// Generated by natural --emit-cpp\n";
+    out << "#include \"natural_runtime.h\"\n\n";
+    out << "int main() {\n";
+    for (auto const &name : names) {
+      if (isNumber(name))
+        out << "  double v_" << name << " = 0;\n";
+      else
+        out << "  nrt::Var v_" << name << "(\"" << name << "\");\n";
+    }
+    out << body.str();
+    out << "  return 0;\n}\n";
+    return out.str();
+  }
+};
+
+// --- PRECOMPILED PROGRAMS ---
+// The parsed program in a flat, position-independent form (.nppc) so runs of
+// an unchanged source can skip the lexer and parser. Nodes are written in
+// preorder as 64-bit words: a NodeTag followed by the node's fields. Strings
+// are (offset, length) pairs into a string pool after the words, and blocks
+// are a statement count followed by the statements, each preceded by its
+// source line. ProgramReader below decodes the same layout. Any change to
+// the tags or to the fields a node writes must bump PROGRAM_VERSION.
+
+enum NodeTag : uint64_t {
+  N_NONE, // absent optional expression
+  N_LITERAL,
+  N_VARIABLE,
+  N_LIST_ACCESS,
+  N_PROPERTY_ACCESS,
+  N_BINARY,
+  N_OBJ_CREATE,
+  N_LIST_CREATE,
+  N_CONTAINS,
+  N_INDEX_OF,
+  N_PRINT,
+  N_VAR_DECL,
+  N_ASSIGN,
+  N_LIST_ASSIGN,
+  N_PROPERTY_ASSIGN,
+  N_ADD_TO_LIST,
+  N_SORT,
+  N_IF,
+  N_WHILE,
+  N_REPEAT,
+  N_CHANNEL_CREATE,
+  N_SEND,
+  N_RECEIVE,
+  N_START_TASK,
+  N_CHECKPOINT,
+};
+
+// Literal encodings following N_LITERAL.
+enum LiteralKind : uint64_t { L_DOUBLE, L_INT, L_STRING };
+
+class Stmt;
+
+class ProgramWriter {
+public:
+  vector<uint64_t> words;
+  string strings;
+
+  void word(uint64_t w) { words.push_back(w); }
+  void text(const string &s) {
+    word(strings.size());
+    word(s.size());
+    strings += s;
+  }
+  void literal(const Value &v) {
+    if (v.type == Value::V_STRING) {
+      word(L_STRING);
+      text(v.str);
+    } else if (v.isInt) {
+      word(L_INT);
+      word((uint64_t)v.inum);
+    } else {
+      uint64_t bits;
+      memcpy(&bits, &v.num, sizeof(bits));
+      word(L_DOUBLE);
+      word(bits);
+    }
+  }
+  void expr(const shared_ptr<Expr> &e);
+  void block(const vector<shared_ptr<Stmt>> &body);
+};
+
+// Walks or rewrites a tree: instrumented runs (see INSTRUMENTATION) and the
+// escape analysis (see ESCAPE ANALYSIS). Nodes hand every child they own to
+// expr() or block(), which may replace it. Children whose value is only read
+// (printed, compared, converted to a number or key) and never stored go to
+// operand() instead, and loop bodies to loop(); both default to the plain
+// hooks.
+class Instrumenter {
+public:
+  virtual void expr(shared_ptr<Expr> &e) = 0;
+  virtual void block(vector<shared_ptr<Stmt>> &body) = 0;
+  virtual void operand(shared_ptr<Expr> &e) { expr(e); }
+  virtual void loop(vector<shared_ptr<Stmt>> &body) { block(body); }
+};
+
+class Expr {
+public:
+  virtual Value evaluate(Environment &env) = 0;
+
+  // Specialised nodes override these to avoid building a Value.
+  virtual Num evaluateNum(Environment &env) { return Num::of(evaluate(env)); }
+  virtual bool evaluateCondition(Environment &env) {
+    return evaluate(env).isTruthy();
+  }
+
+  // Type inference hooks: infer() reports the static type of the node and
+  // visits its children; specialized() returns a replacement node, or null.
+  virtual StaticType infer(TypeScope &scope) { return T_UNKNOWN; }
+  virtual shared_ptr<Expr> specialized() { return nullptr; }
+
+  // C++ backend: source for the node as an nrt::Value, a double, or a bool.
+  virtual string emitValue(CppEmitter &out) = 0;
+  virtual string emitNumber(CppEmitter &out) {
+    return "(" + emitValue(out) + ").num";
+  }
+  virtual string emitCondition(CppEmitter &out) {
+    return "(" + emitValue(out) + ").isTruthy()";
+  }
+
+  // True for `<variable> is equal to <literal>` (either way round), with the
+  // variable's name and the literal. Used to build DispatchTables.
+  virtual bool equalityTest(Str &name, Value &constant) { return false; }
+  virtual const Str *variableName() { return nullptr; }
+  virtual const Value *literal() { return nullptr; }
+
+  // Appends the node to a precompiled program. Specialised nodes write the
+  // generic form, which inference specialises again after loading.
+  virtual void save(ProgramWriter &out) = 0;
+
+  // Instrumentation: passes owned children to the Instrumenter; allocates()
+  // is true for nodes that create a list or object, reuses() for nodes that
+  // clear one for reuse instead.
+  virtual void instrument(Instrumenter &in) {}
+  virtual bool allocates() { return false; }
+  virtual bool reuses() { return false; }
+};
+
+void ProgramWriter::expr(const shared_ptr<Expr> &e) {
+  if (e)
+    e->save(*this);
+  else
+    word(N_NONE);
+}
+
+StaticType TypeScope::infer(shared_ptr<Expr> &expr) {
+  StaticType t = expr->infer(*this);
+  if (rewriting) {
+    if (auto replacement = expr->specialized())
+      expr = replacement;
+  }
+  return t;
+}
+
+class LiteralExpr : public Expr {
+  Value val;
+
+public:
+  LiteralExpr(Value v) : val(v) {}
+  Value evaluate(Environment &env) override { return val; }
+  const Value *literal() override { return &val; }
+  Num evaluateNum(Environment &env) override { return Num::of(val); }
+  StaticType infer(TypeScope &scope) override {
+    return val.type == Value::V_STRING ? T_STRING : T_NUMBER;
+  }
+  string emitValue(CppEmitter &out) override {
+    if (val.type == Value::V_STRING)
+      return "nrt::Value(" + cppString(val.str) + ")";
+    return "nrt::Value(" + cppNumber(val.num) + ")";
+  }
+  string emitNumber(CppEmitter &out) override {
+    return val.type == Value::V_STRING ? "0.0" : cppNumber(val.num);
+  }
+  void save(ProgramWriter &out) override {
+    out.word(N_LITERAL);
+    out.literal(val);
+  }
+};
+
+class VariableExpr : public Expr {
+  Str name;
+
+public:
+  VariableExpr(string n) : name(Str::intern(n)) {}
+  Value evaluate(Environment &env) override { return env.get(name); }
+  const Str *variableName() override { return &name; }
+  Num evaluateNum(Environment &env) override { return env.getNum(name); }
+  StaticType infer(TypeScope &scope) override { return scope.lookup(name); }
+  string emitValue(CppEmitter &out) override {
+    if (out.isNumber(name))
+      return "nrt::Value(" + out.var(name) + ")";
+    return out.var(name) + ".get()";
+  }
+  string emitNumber(CppEmitter &out) override {
+    if (out.isNumber(name))
+      return out.var(name);
+    return out.var(name) + ".get().num";
+  }
+  void save(ProgramWriter &out) override {
+    out.word(N_VARIABLE);
+    out.text(name);
+  }
+};
+
+// Access List elements
+class ListAccessExpr : public Expr {
+  Str name;
+  shared_ptr<Expr> indexExpr;
+
+public:
+  ListAccessExpr(string n, shared_ptr<Expr> idx) : name(Str::intern(n)), indexExpr(idx) {}
+  Value evaluate(Environment &env) override {
+    Value arr = env.get(name);
+    int64_t idx = indexExpr->evaluate(env).index();
+    if (arr.type == Value::V_LIST && idx >= 0 &&
+        (uint64_t)idx < arr.list_val->size()) {
+      return (*arr.list_val)[idx];
+    }
+    return Value(0);
+  }
+  StaticType infer(TypeScope &scope) override {
+    scope.aggregate(name);
+    scope.infer(indexExpr);
+    return T_UNKNOWN;
+  }
+  string emitValue(CppEmitter &out) override {
+    return "nrt::listAt(" + out.var(name) + ", " + indexExpr->emitNumber(out) +
+           ")";
+  }
+  void save(ProgramWriter &out) override {
+    out.word(N_LIST_ACCESS);
+    out.text(name);
+    out.expr(indexExpr);
+  }
+  void instrument(Instrumenter &in) override { in.operand(indexExpr); }
+};
+
+// Access Object elements
+class PropertyAccessExpr : public Expr {
+  shared_ptr<Expr> propExpr;
+  Str objName;
+
+public:
+  PropertyAccessExpr(shared_ptr<Expr> prop, string obj)
+      : propExpr(prop), objName(Str::intern(obj)) {}
+  Value evaluate(Environment &env) override {
+    Value obj = env.get(objName);
+    Value prop = propExpr->evaluate(env);
+    Str key = prop.type == Value::V_STRING ? prop.str : Str(to_string(prop.num));
+
+    if (obj.type == Value::V_OBJECT &&
+        obj.obj_val->find(key) != obj.obj_val->end()) {
+      return obj.obj_val->at(key);
+    }
+    return Value(0);
+  }
+  StaticType infer(TypeScope &scope) override {
+    scope.aggregate(objName);
+    scope.infer(propExpr);
+    return T_UNKNOWN;
+  }
+  string emitValue(CppEmitter &out) override {
+    return "nrt::propertyGet(" + out.var(objName) + ", " +
+           propExpr->emitValue(out) + ")";
+  }
+  void save(ProgramWriter &out) override {
+    out.word(N_PROPERTY_ACCESS);
+    out.expr(propExpr);
+    out.text(objName);
+  }
+  void instrument(Instrumenter &in) override { in.operand(propExpr); }
+};
+
+// Arithmetic and comparison on operands proven to be numbers.
+class NumberBinaryExpr : public Expr {
+  shared_ptr<Expr> left;
+  TokenType op;
+  shared_ptr<Expr> right;
+
+public:
+  NumberBinaryExpr(shared_ptr<Expr> l, TokenType o, shared_ptr<Expr> r)
+      : left(l), op(o), right(r) {}
+  Value evaluate(Environment &env) override {
+    return evaluateNum(env).toValue();
+  }
+  Num evaluateNum(Environment &env) override {
+    if (op == EQUAL || op == LESS)
+      return Num((int64_t)(evaluateCondition(env) ? 1 : 0));
+    Num l = left->evaluateNum(env);
+    Num r = right->evaluateNum(env);
+    switch (op) {
+    case PLUS:
+      return numAdd(l, r);
+    case MINUS:
+      return numSub(l, r);
+    case TIMES_OP:
+      return numMul(l, r);
+    case DIVIDED_BY:
+      return numDiv(l, r);
+    default:
+      return Num((int64_t)0);
+    }
+  }
+  bool evaluateCondition(Environment &env) override {
+    if (op == EQUAL)
+      return numEqual(left->evaluateNum(env), right->evaluateNum(env));
+    if (op == LESS)
+      return numLess(left->evaluateNum(env), right->evaluateNum(env));
+    return evaluateNum(env).isTruthy();
+  }
+  StaticType infer(TypeScope &scope) override { return T_NUMBER; }
+
+  string emitValue(CppEmitter &out) override {
+    return "nrt::Value(" + emitNumber(out) + ")";
+  }
+  string emitNumber(CppEmitter &out) override {
+    if (op == EQUAL || op == LESS)
+      return "(" + emitCondition(out) + " ? 1.0 : 0.0)";
+    string l = left->emitNumber(out);
+    string r = right->emitNumber(out);
+    switch (op) {
+    case PLUS:
+      return "(" + l + " + " + r + ")";
+    case MINUS:
+      return "(" + l + " - " + r + ")";
+    case TIMES_OP:
+      return "(" + l + " * " + r + ")";
+    case DIVIDED_BY:
+      return "(" + l + " / " + r + ")";
+    default:
+      return "0.0";
+    }
+  }
+  string emitCondition(CppEmitter &out) override {
+    if (op == EQUAL)
+      return "(" + left->emitNumber(out) + " == " + right->emitNumber(out) +
+             ")";
+    if (op == LESS)
+      return "(" + left->emitNumber(out) + " < " + right->emitNumber(out) +
+             ")";
+    return "(" + emitNumber(out) + " != 0)";
+  }
+  void save(ProgramWriter &out) override {
+    out.word(N_BINARY);
+    out.expr(left);
+    out.word(op);
+    out.expr(right);
+  }
+  void instrument(Instrumenter &in) override {
+    in.operand(left);
+    in.operand(right);
+  }
+};
+
+// Concatenation of two operands proven to be strings.
+class StringConcatExpr : public Expr {
+  shared_ptr<Expr> left;
+  shared_ptr<Expr> right;
+
+public:
+  StringConcatExpr(shared_ptr<Expr> l, shared_ptr<Expr> r)
+      : left(l), right(r) {}
+  Value evaluate(Environment &env) override {
+    return Value(left->evaluate(env).str.text() +
+                 right->evaluate(env).str.text());
+  }
+  bool evaluateCondition(Environment &env) override {
+    return !left->evaluate(env).str.empty() ||
+           !right->evaluate(env).str.empty();
+  }
+  StaticType infer(TypeScope &scope) override { return T_STRING; }
+  string emitValue(CppEmitter &out) override {
+    return "nrt::Value((" + left->emitValue(out) + ").str + (" +
+           right->emitValue(out) + ").str)";
+  }
+  void save(ProgramWriter &out) override {
+    out.word(N_BINARY);
+    out.expr(left);
+    out.word(PLUS);
+    out.expr(right);
+  }
+  void instrument(Instrumenter &in) override {
+    in.operand(left);
+    in.operand(right);
+  }
+};
+
+// Equality of two operands proven to be strings.
+class StringEqualExpr : public Expr {
+  shared_ptr<Expr> left;
+  shared_ptr<Expr> right;
+
+public:
+  StringEqualExpr(shared_ptr<Expr> l, shared_ptr<Expr> r)
+      : left(l), right(r) {}
+  Value evaluate(Environment &env) override {
+    return Value::fromInt(evaluateCondition(env) ? 1 : 0);
+  }
+  Num evaluateNum(Environment &env) override {
+    return Num((int64_t)(evaluateCondition(env) ? 1 : 0));
+  }
+  bool evaluateCondition(Environment &env) override {
+    return left->evaluate(env).str == right->evaluate(env).str;
+  }
+  StaticType infer(TypeScope &scope) override { return T_NUMBER; }
+  string emitValue(CppEmitter &out) override {
+    return "nrt::Value(" + emitNumber(out) + ")";
+  }
+  string emitNumber(CppEmitter &out) override {
+    return "(" + emitCondition(out) + " ? 1.0 : 0.0)";
+  }
+  string emitCondition(CppEmitter &out) override {
+    return "((" + left->emitValue(out) + ").str == (" +
+           right->emitValue(out) + ").str)";
+  }
+  void save(ProgramWriter &out) override {
+    out.word(N_BINARY);
+    out.expr(left);
+    out.word(EQUAL);
+    out.expr(right);
+  }
+  void instrument(Instrumenter &in) override {
+    in.operand(left);
+    in.operand(right);
+  }
+};
+
+class BinaryExpr : public Expr {
+  shared_ptr<Expr> left;
+  TokenType op;
+  shared_ptr<Expr> right;
+  StaticType leftType = T_UNKNOWN;
+  StaticType rightType = T_UNKNOWN;
+
+public:
+  BinaryExpr(shared_ptr<Expr> l, TokenType o, shared_ptr<Expr> r)
+      : left(l), op(o), right(r) {}
+  Value evaluate(Environment &env) override {
+    Value l = left->evaluate(env);
+    Value r = right->evaluate(env);
+
+    if (op == PLUS) {
+      if (l.type == Value::V_STRING || r.type == Value::V_STRING) {
+        return Value(l.stringify() + r.stringify());
+      }
+      return numAdd(Num::of(l), Num::of(r)).toValue();
+    }
+    if (op == MINUS)
+      return numSub(Num::of(l), Num::of(r)).toValue();
+    if (op == TIMES_OP)
+      return numMul(Num::of(l), Num::of(r)).toValue();
+    if (op == DIVIDED_BY)
+      return numDiv(Num::of(l), Num::of(r)).toValue();
+    if (op == EQUAL)
+      return Value::fromInt(
+          numEqual(Num::of(l), Num::of(r)) && l.str == r.str ? 1 : 0);
+    if (op == LESS)
+      return Value::fromInt(numLess(Num::of(l), Num::of(r)) ? 1 : 0);
+
+    return Value(0);
+  }
+
+  bool equalityTest(Str &name, Value &constant) override {
+    if (op != EQUAL)
+      return false;
+    const Str *var = left->variableName();
+    const Value *lit = right->literal();
+    if (!var || !lit) {
+      var = right->variableName();
+      lit = left->literal();
+    }
+    if (!var || !lit)
+      return false;
+    name = *var;
+    constant = *lit;
+    return true;
+  }
+
+  StaticType infer(TypeScope &scope) override {
+    leftType = scope.infer(left);
+    rightType = scope.infer(right);
+    if (op == PLUS) {
+      if (leftType == T_STRING || rightType == T_STRING)
+        return T_STRING;
+      if (leftType == T_UNKNOWN || rightType == T_UNKNOWN)
+        return T_UNKNOWN;
+    }
+    return T_NUMBER;
+  }
+
+  shared_ptr<Expr> specialized() override {
+    bool numbers = leftType == T_NUMBER && rightType == T_NUMBER;
+    bool strings = leftType == T_STRING && rightType == T_STRING;
+    switch (op) {
+    case PLUS:
+      if (numbers)
+        return make_shared<NumberBinaryExpr>(left, op, right);
+      if (strings)
+        return make_shared<StringConcatExpr>(left, right);
+      return nullptr;
+    case MINUS:
+    case TIMES_OP:
+    case DIVIDED_BY:
+    case LESS:
+      // Non-numbers contribute their (zero) num field, so these only need
+      // the operands to be numbers for the result to be identical.
+      if (numbers)
+        return make_shared<NumberBinaryExpr>(left, op, right);
+      return nullptr;
+    case EQUAL:
+      if (numbers)
+        return make_shared<NumberBinaryExpr>(left, op, right);
+      if (strings)
+        return make_shared<StringEqualExpr>(left, right);
+      return nullptr;
+    default:
+      return nullptr;
+    }
+  }
+
+  string emitValue(CppEmitter &out) override {
+    switch (op) {
+    case PLUS:
+      return "nrt::plus(" + left->emitValue(out) + ", " +
+             right->emitValue(out) + ")";
+    case EQUAL:
+      return "nrt::equal(" + left->emitValue(out) + ", " +
+             right->emitValue(out) + ")";
+    case MINUS:
+      return "nrt::Value(" + left->emitNumber(out) + " - " +
+             right->emitNumber(out) + ")";
+    case TIMES_OP:
+      return "nrt::Value(" + left->emitNumber(out) + " * " +
+             right->emitNumber(out) + ")";
+    case DIVIDED_BY:
+      return "nrt::Value(" + left->emitNumber(out) + " / " +
+             right->emitNumber(out) + ")";
+    case LESS:
+      return "nrt::Value(" + left->emitNumber(out) + " < " +
+             right->emitNumber(out) + " ? 1.0 : 0.0)";
+    default:
+      return "nrt::Value(0.0)";
+    }
+  }
+
+  void save(ProgramWriter &out) override {
+    out.word(N_BINARY);
+    out.expr(left);
+    out.word(op);
+    out.expr(right);
+  }
+  void instrument(Instrumenter &in) override {
+    in.operand(left);
+    in.operand(right);
+  }
+};
+
+// --- TASKS & CHANNELS (coroutines) ---
+// Statements that can block on a channel also run as C++20 coroutines, so a
+// waiting task suspends instead of holding a thread. TaskStep is the
+// coroutine type: awaiting one runs it inside the awaiting task, and the
+// outermost step of a task reports completion to the scheduler.
+
+struct TaskStep {
+  struct promise_type {
+    Task *task = nullptr;
+    coroutine_handle<> continuation;
+
+    TaskStep get_return_object() {
+      return TaskStep(coroutine_handle<promise_type>::from_promise(*this));
+    }
+    suspend_always initial_suspend() noexcept { return {}; }
+
+    struct FinalAwaiter {
+      bool await_ready() noexcept { return false; }
+      coroutine_handle<>
+      await_suspend(coroutine_handle<promise_type> h) noexcept;
+      void await_resume() noexcept {}
+    };
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { terminate(); }
+  };
+
+  coroutine_handle<promise_type> handle;
+
+  explicit TaskStep(coroutine_handle<promise_type> h) : handle(h) {}
+  TaskStep(TaskStep &&other) noexcept : handle(other.handle) {
+    other.handle = nullptr;
+  }
+  TaskStep(const TaskStep &) = delete;
+  ~TaskStep() {
+    if (handle)
+      handle.destroy();
+  }
+
+  bool await_ready() { return false; }
+  coroutine_handle<> await_suspend(coroutine_handle<promise_type> parent) {
+    handle.promise().task = parent.promise().task;
+    handle.promise().continuation = parent;
+    return handle;
+  }
+  void await_resume() {}
+};
+
+class Stmt {
+public:
+  uint32_t line = 0; // source line of the first token; 0 if unknown
+
+  virtual void execute(Environment &env) = 0;
+
+  // True if the statement (or one nested in it) uses tasks or channels and
+  // so has to go through run() under the scheduler.
+  virtual bool mayBlock() { return false; }
+  virtual TaskStep run(Environment &env) {
+    execute(env);
+    co_return;
+  }
+
+  // Propagates variable types through the statement and specialises the
+  // expressions it owns.
+  virtual void infer(TypeScope &scope) {}
+
+  // C++ backend: appends the statement's translation.
+  virtual void emit(CppEmitter &out) = 0;
+
+  // Appends the statement to a precompiled program.
+  virtual void save(ProgramWriter &out) = 0;
+
+  // Instrumentation: passes owned children to the Instrumenter; target() is
+  // the variable the statement writes (itself or one of its elements).
+  virtual void instrument(Instrumenter &in) {}
+  virtual const Str *target() { return nullptr; }
+};
+
+void ProgramWriter::block(const vector<shared_ptr<Stmt>> &body) {
+  word(body.size());
+  for (auto &stmt : body) {
+    word(stmt->line);
+    stmt->save(*this);
+  }
+}
+
+static bool anyMayBlock(const vector<shared_ptr<Stmt>> &body) {
+  for (auto &stmt : body)
+    if (stmt->mayBlock())
+      return true;
+  return false;
+}
+
+// Runs a block inside a task; only statements that may block pay for a
+// coroutine frame.
+static TaskStep runBlock(vector<shared_ptr<Stmt>> &body, Environment &env) {
+  for (auto &stmt : body) {
+    if (stmt->mayBlock())
+      co_await stmt->run(env);
+    else
+      stmt->execute(env);
+  }
+}
+
+class PrintStmt : public Stmt {
+  shared_ptr<Expr> expr;
+
+public:
+  PrintStmt(shared_ptr<Expr> e) : expr(e) {}
+  void execute(Environment &env) override {
+    Value v = expr->evaluate(env);
+    if (!env.outputLock) {
+      v.print(env.out, env.display);
+      return;
+    }
+    // Streamed under the lock rather than buffered, so a large value still
+    // prints in bounded memory; tasks' values are private (see
+    // StartTaskStmt), so no other thread changes it meanwhile.
+    lock_guard<mutex> guard(*env.outputLock);
+    v.print(env.out, env.display);
+    env.out << flush;
+  }
+  void infer(TypeScope &scope) override { scope.infer(expr); }
+  void emit(CppEmitter &out) override {
+    out.line("nrt::print(" + expr->emitValue(out) + ");");
+  }
+  void save(ProgramWriter &out) override {
+    out.word(N_PRINT);
+    out.expr(expr);
+  }
+  void instrument(Instrumenter &in) override { in.operand(expr); }
+};
+
+class VarDeclStmt : public Stmt {
+  Str name;
+  shared_ptr<Expr> initializer;
+
+public:
+  VarDeclStmt(string n, shared_ptr<Expr> init) : name(Str::intern(n)), initializer(init) {}
+  void execute(Environment &env) override {
+    env.define(name, initializer->evaluate(env));
+  }
+  void infer(TypeScope &scope) override {
+    scope.define(name, scope.infer(initializer));
+  }
+  void emit(CppEmitter &out) override {
+    if (out.isNumber(name))
+      out.line(out.var(name) + " = " + initializer->emitNumber(out) + ";");
+    else
+      out.line(out.var(name) + ".define(" + initializer->emitValue(out) +
+               ");");
+  }
+  void save(ProgramWriter &out) override {
+    out.word(N_VAR_DECL);
+    out.text(name);
+    out.expr(initializer);
+  }
+  void instrument(Instrumenter &in) override { in.expr(initializer); }
+  const Str *target() override { return &name; }
+  // T_LIST or T_OBJECT for `create list` / `create object`, else T_UNKNOWN.
+  StaticType creates() const;
+};
+
+// Object/List creation fake exprs (helper nodes)
+class ObjCreateExpr : public Expr {
+public:
+  Value evaluate(Environment &env) override {
+    env.allocations.objects++;
+    return Value::createObject();
+  }
+  StaticType infer(TypeScope &scope) override { return T_OBJECT; }
+  string emitValue(CppEmitter &out) override {
+    return "nrt::Value::createObject()";
+  }
+  void save(ProgramWriter &out) override { out.word(N_OBJ_CREATE); }
+  bool allocates() override { return true; }
+};
+class ListCreateExpr : public Expr {
+public:
+  Value evaluate(Environment &env) override {
+    env.allocations.lists++;
+    return Value::createList();
+  }
+  StaticType infer(TypeScope &scope) override { return T_LIST; }
+  string emitValue(CppEmitter &out) override {
+    return "nrt::Value::createList()";
+  }
+  void save(ProgramWriter &out) override { out.word(N_LIST_CREATE); }
+  bool allocates() override { return true; }
+};
+
+StaticType VarDeclStmt::creates() const {
+  if (dynamic_cast<ListCreateExpr *>(initializer.get()))
+    return T_LIST;
+  if (dynamic_cast<ObjCreateExpr *>(initializer.get()))
+    return T_OBJECT;
+  return T_UNKNOWN;
+}
+
+class AssignStmt : public Stmt {
+  Str name;
+  shared_ptr<Expr> value;
+
+public:
+  AssignStmt(string n, shared_ptr<Expr> v) : name(Str::intern(n)), value(v) {}
+  void execute(Environment &env) override {
+    env.assign(name, value->evaluate(env));
+  }
+  void infer(TypeScope &scope) override {
+    scope.assign(name, scope.infer(value));
+  }
+  void emit(CppEmitter &out) override {
+    if (out.isNumber(name))
+      out.line(out.var(name) + " = " + value->emitNumber(out) + ";");
+    else
+      out.line(out.var(name) + ".assign(" + value->emitValue(out) + ");");
+  }
+  void save(ProgramWriter &out) override {
+    out.word(N_ASSIGN);
+    out.text(name);
+    out.expr(value);
+  }
+  void instrument(Instrumenter &in) override { in.expr(value); }
+  const Str *target() override { return &name; }
+};
+
+class ListAssignStmt : public Stmt {
+  Str name;
+  shared_ptr<Expr> indexExpr;
+  shared_ptr<Expr> value;
+
+public:
+  ListAssignStmt(string n, shared_ptr<Expr> idx, shared_ptr<Expr> val)
+      : name(Str::intern(n)), indexExpr(idx), value(val) {}
+  void execute(Environment &env) override {
+    Value arr = env.get(name);
+    int64_t idx = indexExpr->evaluate(env).index();
+    if (arr.type == Value::V_LIST && idx >= 0) {
+      if (arr.list_val->size() <= (uint64_t)idx) {
+        if ((uint64_t)idx - arr.list_val->size() > ListData::MAX_GROWTH_GAP) {
+          env.errors++;
+          env.write(env.err, "Error: index " + to_string(idx) +
+                                 " is too far past the end of list " +
+                                 name.text() + ".\n");
+          return;
+        }
+        arr.list_val->resize(idx + 1);
+      }
+      (*arr.list_val)[idx] = value->evaluate(env);
+      arr.list_val->changed();
+    }
+  }
+  void infer(TypeScope &scope) override {
+    scope.aggregate(name);
+    scope.infer(indexExpr);
+    scope.infer(value);
+  }
+  void emit(CppEmitter &out) override {
+    out.line("nrt::listSet(" + out.var(name) + ", " +
+             indexExpr->emitNumber(out) + ", " + value->emitValue(out) + ");");
+  }
+  void save(ProgramWriter &out) override {
+    out.word(N_LIST_ASSIGN);
+    out.text(name);
+    out.expr(indexExpr);
+    out.expr(value);
+  }
+  void instrument(Instrumenter &in) override {
+    in.operand(indexExpr);
+    in.expr(value);
+  }
+  const Str *target() override { return &name; }
+};
+
+class PropertyAssignStmt : public Stmt {
+  Str name;
+  shared_ptr<Expr> propExpr;
+  shared_ptr<Expr> value;
+
+public:
+  PropertyAssignStmt(string n, shared_ptr<Expr> p, shared_ptr<Expr> v)
+      : name(Str::intern(n)), propExpr(p), value(v) {}
+  void execute(Environment &env) override {
+    Value obj = env.get(name);
+    Value prop = propExpr->evaluate(env);
+    Str key = prop.type == Value::V_STRING ? prop.str : Str(prop.stringify());
+
+    if (obj.type == Value::V_OBJECT) {
+      (*obj.obj_val)[key] = value->evaluate(env);
+    }
+  }
+  void infer(TypeScope &scope) override {
+    scope.aggregate(name);
+    scope.infer(propExpr);
+    scope.infer(value);
+  }
+  void emit(CppEmitter &out) override {
+    out.line("nrt::propertySet(" + out.var(name) + ", " +
+             propExpr->emitValue(out) + ", " + value->emitValue(out) + ");");
+  }
+  void save(ProgramWriter &out) override {
+    out.word(N_PROPERTY_ASSIGN);
+    out.text(name);
+    out.expr(propExpr);
+    out.expr(value);
+  }
+  void instrument(Instrumenter &in) override {
+    in.operand(propExpr);
+    in.expr(value);
+  }
+  const Str *target() override { return &name; }
+};
+
+class AddToListStmt : public Stmt {
+  Str name;
+  shared_ptr<Expr> value;
+
+public:
+  AddToListStmt(string n, shared_ptr<Expr> v) : name(Str::intern(n)), value(v) {}
+  void execute(Environment &env) override {
+    Value arr = env.get(name);
+    if (arr.type == Value::V_LIST) {
+      arr.list_val->push_back(value->evaluate(env));
+      arr.list_val->appended();
+    }
+  }
+  void infer(TypeScope &scope) override {
+    scope.aggregate(name);
+    scope.infer(value);
+  }
+  void emit(CppEmitter &out) override {
+    out.line("nrt::listAdd(" + out.var(name) + ", " + value->emitValue(out) +
+             ");");
+  }
+  void save(ProgramWriter &out) override {
+    out.word(N_ADD_TO_LIST);
+    out.text(name);
+    out.expr(value);
+  }
+  void instrument(Instrumenter &in) override { in.expr(value); }
+  const Str *target() override { return &name; }
+};
+
+// sort <list> [by property <key>]
+class SortStmt : public Stmt {
+  Str name;
+  shared_ptr<Expr> propExpr; // null for a plain sort
+
+public:
+  SortStmt(string n, shared_ptr<Expr> p) : name(Str::intern(n)), propExpr(p) {}
+  void execute(Environment &env) override {
+    Value arr = env.get(name);
+    if (arr.type != Value::V_LIST)
+      return;
+    if (!propExpr) {
+      arr.list_val->sort();
+      return;
+    }
+    Value prop = propExpr->evaluate(env);
+    arr.list_val->sortBy(prop.type == Value::V_STRING ? prop.str
+                                                      : Str(to_string(prop.num)));
+  }
+  void infer(TypeScope &scope) override {
+    scope.aggregate(name);
+    if (propExpr)
+      scope.infer(propExpr);
+  }
+  void emit(CppEmitter &out) override {
+    if (propExpr)
+      out.line("nrt::listSortBy(" + out.var(name) + ", " +
+               propExpr->emitValue(out) + ");");
+    else
+      out.line("nrt::listSort(" + out.var(name) + ");");
+  }
+  void save(ProgramWriter &out) override {
+    out.word(N_SORT);
+    out.text(name);
+    out.expr(propExpr);
+  }
+  void instrument(Instrumenter &in) override { in.operand(propExpr); }
+  const Str *target() override { return &name; }
+};
+
+// <list> contains <value>: 1 if some element is the same value, else 0.
+class ContainsExpr : public Expr {
+  shared_ptr<Expr> list;
+  shared_ptr<Expr> value;
+
+public:
+  ContainsExpr(shared_ptr<Expr> l, shared_ptr<Expr> v) : list(l), value(v) {}
+  Value evaluate(Environment &env) override {
+    return Value::fromInt(evaluateCondition(env) ? 1 : 0);
+  }
+  Num evaluateNum(Environment &env) override {
+    return Num((int64_t)(evaluateCondition(env) ? 1 : 0));
+  }
+  bool evaluateCondition(Environment &env) override {
+    Value arr = list->evaluate(env);
+    Value v = value->evaluate(env);
+    return arr.type == Value::V_LIST && arr.list_val->find(v) >= 0;
+  }
+  StaticType infer(TypeScope &scope) override {
+    scope.infer(list);
+    scope.infer(value);
+    return T_NUMBER;
+  }
+  string emitValue(CppEmitter &out) override {
+    return "nrt::Value(" + emitNumber(out) + ")";
+  }
+  string emitNumber(CppEmitter &out) override {
+    return "(" + emitCondition(out) + " ? 1.0 : 0.0)";
+  }
+  string emitCondition(CppEmitter &out) override {
+    return "(nrt::listFind(" + list->emitValue(out) + ", " +
+           value->emitValue(out) + ") >= 0)";
+  }
+  void save(ProgramWriter &out) override {
+    out.word(N_CONTAINS);
+    out.expr(list);
+    out.expr(value);
+  }
+  void instrument(Instrumenter &in) override {
+    in.operand(list);
+    in.operand(value);
+  }
+};
+
+// index of <value> in [sorted] <list>: position of the first element that is
+// the same value, or -1. `sorted` binary-searches a list in `sort` order
+// instead of consulting its hash index.
+class IndexOfExpr : public Expr {
+  shared_ptr<Expr> value;
+  shared_ptr<Expr> list;
+  bool sorted;
+
+public:
+  IndexOfExpr(shared_ptr<Expr> v, shared_ptr<Expr> l, bool s)
+      : value(v), list(l), sorted(s) {}
+  Value evaluate(Environment &env) override {
+    return evaluateNum(env).toValue();
+  }
+  Num evaluateNum(Environment &env) override {
+    Value v = value->evaluate(env);
+    Value arr = list->evaluate(env);
+    if (arr.type != Value::V_LIST)
+      return Num((int64_t)-1);
+    return Num(sorted ? arr.list_val->search(v) : arr.list_val->find(v));
+  }
+  StaticType infer(TypeScope &scope) override {
+    scope.infer(value);
+    scope.infer(list);
+    return T_NUMBER;
+  }
+  string emitValue(CppEmitter &out) override {
+    return "nrt::Value(" + emitNumber(out) + ")";
+  }
+  string emitNumber(CppEmitter &out) override {
+    return string(sorted ? "nrt::listSearch(" : "nrt::listFind(") +
+           list->emitValue(out) + ", " + value->emitValue(out) + ")";
+  }
+  void save(ProgramWriter &out) override {
+    out.word(N_INDEX_OF);
+    out.expr(value);
+    out.expr(list);
+    out.word(sorted);
+  }
+  void instrument(Instrumenter &in) override {
+    in.operand(value);
+    in.operand(list);
+  }
+};
+
+// Arm lookup for an `otherwise if` chain whose every arm is `<variable> is
+// equal to <constant>`. Reproduces BinaryExpr's EQUAL, where both num and
+// str must match: a nonempty string can only hit a string arm, and the
+// constants 0 and "" also match lists and objects (num 0, str "").
+struct DispatchTable {
+  static const size_t NONE = SIZE_MAX;
+
+  Str name;
+  unordered_map<Str, size_t, StrHash> strings; // nonempty string -> arm
+  unordered_map<double, size_t> numbers; // numeric constant -> arm
+  vector<Value> constants;               // per arm
+  size_t emptyString = NONE;             // arm testing ""
+
+  // Adds the next arm; false if its constant collides with an earlier
+  // numeric one without being equal to it (distinct int64s that round to
+  // the same double). Repeated constants keep their first, reachable arm.
+  bool add(const Value &constant) {
+    size_t arm = constants.size();
+    constants.push_back(constant);
+    if (constant.type == Value::V_STRING) {
+      if (constant.str.empty()) {
+        if (emptyString == NONE)
+          emptyString = arm;
+      } else {
+        strings.emplace(constant.str, arm);
+      }
+      return true;
+    }
+    auto it = numbers.find(constant.num);
+    if (it == numbers.end()) {
+      numbers.emplace(constant.num, arm);
+      return true;
+    }
+    return numEqual(Num::of(constant), Num::of(constants[it->second]));
+  }
+
+  // First arm whose test `v` passes, or NONE.
+  size_t lookup(const Value &v) const {
+    if (!v.str.empty()) {
+      auto it = strings.find(v.str);
+      return it == strings.end() ? NONE : it->second;
+    }
+    size_t arm = NONE;
+    auto it = numbers.find(v.num);
+    if (it != numbers.end() &&
+        numEqual(Num::of(v), Num::of(constants[it->second])))
+      arm = it->second;
+    if (v.num == 0 && emptyString < arm)
+      arm = emptyString;
+    return arm;
+  }
+};
+
+// if ... otherwise if ... otherwise ... end if. Chains of at least
+// DISPATCH_MIN_ARMS equality tests on one variable pick their arm through a
+// DispatchTable instead of testing the conditions in turn.
+class IfStmt : public Stmt {
+public:
+  struct Arm {
+    shared_ptr<Expr> condition;
+    vector<shared_ptr<Stmt>> body;
+  };
+  static const size_t DISPATCH_MIN_ARMS = 4;
+
+private:
+  vector<Arm> arms;
+  vector<shared_ptr<Stmt>> otherwise;
+  bool blocking;
+  unique_ptr<DispatchTable> table; // null unless the chain qualifies
+
+  // Built from the parsed conditions, before inference specialises them.
+  void buildTable() {
+    if (arms.size() < DISPATCH_MIN_ARMS)
+      return;
+    auto t = make_unique<DispatchTable>();
+    for (auto &arm : arms) {
+      Str name;
+      Value constant;
+      if (!arm.condition->equalityTest(name, constant))
+        return;
+      if (&arm != &arms[0] && name != t->name)
+        return;
+      t->name = name;
+      if (!t->add(constant))
+        return;
+    }
+    table = move(t);
+  }
+
+  vector<shared_ptr<Stmt>> &select(Environment &env) {
+    if (table) {
+      // An undefined variable reports an error per test, so leave that case
+      // to the chain.
+      if (const Value *v = env.find(table->name)) {
+        size_t arm = table->lookup(*v);
+        return arm == DispatchTable::NONE ? otherwise : arms[arm].body;
+      }
+    }
+    for (auto &arm : arms)
+      if (arm.condition->evaluateCondition(env))
+        return arm.body;
+    return otherwise;
+  }
+
+public:
+  IfStmt(vector<Arm> a, vector<shared_ptr<Stmt>> o)
+      : arms(a), otherwise(o), blocking(anyMayBlock(o)) {
+    for (auto &arm : arms)
+      blocking = blocking || anyMayBlock(arm.body);
+    buildTable();
+  }
+
+  void execute(Environment &env) override {
+    for (auto &stmt : select(env))
+      stmt->execute(env);
+  }
+  bool mayBlock() override { return blocking; }
+  TaskStep run(Environment &env) override {
+    co_await runBlock(select(env), env);
+  }
+
+  // Each arm starts from the state after its own condition; later
+  // conditions are only reached when the earlier ones failed.
+  void infer(TypeScope &scope) override {
+    vector<TypeScope> taken;
+    for (auto &arm : arms) {
+      scope.infer(arm.condition);
+      taken.push_back(scope);
+      for (auto &stmt : arm.body)
+        stmt->infer(taken.back());
+    }
+    for (auto &stmt : otherwise)
+      stmt->infer(scope);
+    for (auto &branch : taken)
+      scope.join(branch);
+  }
+
+  void emit(CppEmitter &out) override {
+    for (size_t i = 0; i < arms.size(); i++) {
+      string test = "if (" + arms[i].condition->emitCondition(out) + ") {";
+      if (i == 0)
+        out.open(test);
+      else
+        out.reopen("} else " + test);
+      for (auto &stmt : arms[i].body)
+        stmt->emit(out);
+    }
+    if (!otherwise.empty()) {
+      out.reopen("} else {");
+      for (auto &stmt : otherwise)
+        stmt->emit(out);
+    }
+    out.close("}");
+  }
+
+  void save(ProgramWriter &out) override {
+    out.word(N_IF);
+    out.word(arms.size());
+    for (auto &arm : arms) {
+      out.expr(arm.condition);
+      out.block(arm.body);
+    }
+    out.block(otherwise);
+  }
+  void instrument(Instrumenter &in) override {
+    for (auto &arm : arms) {
+      in.operand(arm.condition);
+      in.block(arm.body);
+    }
+    in.block(otherwise);
+  }
+};
+
+// Infers a loop body (and its condition, if any). Iterates to a fixpoint on
+// the loop-head state without touching the tree, then specialises the body
+// once against that state. The lattice only moves towards
+// T_UNKNOWN/T_UNDEFINED so this terminates quickly.
+static void inferLoop(TypeScope &scope, shared_ptr<Expr> *condition,
+                      vector<shared_ptr<Stmt>> &body) {
+  bool rewriting = scope.rewriting;
+  scope.rewriting = false;
+  while (true) {
+    TypeScope iteration = scope;
+    if (condition)
+      iteration.infer(*condition);
+    for (auto &stmt : body)
+      stmt->infer(iteration);
+    TypeScope head = scope;
+    head.join(iteration);
+    if (head == scope)
+      break;
+    scope = head;
+  }
+  scope.rewriting = rewriting;
+
+  TypeScope iteration = scope;
+  if (condition)
+    iteration.infer(*condition);
+  for (auto &stmt : body)
+    stmt->infer(iteration);
+}
+
+class WhileStmt : public Stmt {
+  shared_ptr<Expr> condition;
+  vector<shared_ptr<Stmt>> body;
+  bool blocking;
+
+public:
+  WhileStmt(shared_ptr<Expr> cond, vector<shared_ptr<Stmt>> b)
+      : condition(cond), body(b), blocking(anyMayBlock(b)) {}
+  void execute(Environment &env) override {
+    while (condition->evaluateCondition(env)) {
+      for (auto &stmt : body)
+        stmt->execute(env);
+    }
+  }
+  bool mayBlock() override { return blocking; }
+  TaskStep run(Environment &env) override {
+    while (condition->evaluateCondition(env))
+      co_await runBlock(body, env);
+  }
+
+  void infer(TypeScope &scope) override {
+    inferLoop(scope, &condition, body);
+  }
+
+  void emit(CppEmitter &out) override {
+    out.open("while (" + condition->emitCondition(out) + ") {");
+    for (auto &stmt : body)
+      stmt->emit(out);
+    out.close("}");
+  }
+  void save(ProgramWriter &out) override {
+    out.word(N_WHILE);
+    out.expr(condition);
+    out.block(body);
+  }
+  void instrument(Instrumenter &in) override {
+    in.operand(condition);
+    in.loop(body);
+  }
+};
+
+// repeat <count> times ... end repeat. The count is evaluated once and the
+// counter is a native integer.
+class RepeatStmt : public Stmt {
+  shared_ptr<Expr> count;
+  vector<shared_ptr<Stmt>> body;
+  bool blocking;
+
+public:
+  RepeatStmt(shared_ptr<Expr> c, vector<shared_ptr<Stmt>> b)
+      : count(c), body(b), blocking(anyMayBlock(b)) {}
+  void execute(Environment &env) override {
+    int64_t n = count->evaluate(env).index();
+    for (int64_t i = 0; i < n; i++) {
+      for (auto &stmt : body)
+        stmt->execute(env);
+    }
+  }
+  bool mayBlock() override { return blocking; }
+  TaskStep run(Environment &env) override {
+    int64_t n = count->evaluate(env).index();
+    for (int64_t i = 0; i < n; i++)
+      co_await runBlock(body, env);
+  }
+
+  void infer(TypeScope &scope) override {
+    scope.infer(count);
+    inferLoop(scope, nullptr, body);
+  }
+
+  void emit(CppEmitter &out) override {
+    string i = out.temp("i"), n = out.temp("n");
+    out.open("for (int64_t " + i + " = 0, " + n + " = (int64_t)(" +
+             count->emitNumber(out) + "); " + i + " < " + n + "; " + i +
+             "++) {");
+    for (auto &stmt : body)
+      stmt->emit(out);
+    out.close("}");
+  }
+  void save(ProgramWriter &out) override {
+    out.word(N_REPEAT);
+    out.expr(count);
+    out.block(body);
+  }
+  void instrument(Instrumenter &in) override {
+    in.operand(count);
+    in.loop(body);
+  }
+};
+
+// A spawned task: its own copy of the variables at spawn time, down to the
+// lists and objects they hold, and the outermost coroutine running its
+// block.
+struct Task {
+  class Scheduler *scheduler;
+  unique_ptr<Environment> ownedEnv;
+  Environment &env;
+  TaskStep body;
+  coroutine_handle<> resumePoint;
+  size_t worker = 0;
+
+  Task(Scheduler *s, unique_ptr<Environment> owned, Environment &e,
+       TaskStep b)
+      : scheduler(s), ownedEnv(move(owned)), env(e), body(move(b)),
+        resumePoint(body.handle) {}
+};
+
+// A bounded FIFO of values. Capacity 0 makes every send wait for a receiver.
+// Each operation either completes immediately or parks the calling task
+// (with the coroutine to resume) until a peer completes it.
+class Channel {
+  struct Waiter {
+    Task *task;
+    coroutine_handle<> handle;
+    Value value;          // senders: the value being sent
+    Value *slot = nullptr; // receivers: where to deliver
+  };
+  mutex lock;
+  size_t capacity;
+  deque<Value> buffer;
+  deque<Waiter> senders;
+  deque<Waiter> receivers;
+
+public:
+  explicit Channel(size_t c) : capacity(c) {}
+
+  // Returns true if the task must suspend.
+  bool send(Task *task, coroutine_handle<> h, Value &value);
+  bool receive(Task *task, coroutine_handle<> h, Value &slot);
+};
+
+// Runs tasks on a fixed set of workers, each with its own run queue; an idle
+// worker steals from the others. With one worker everything runs on the
+// calling thread in spawn/wake order, so output is deterministic.
+class Scheduler {
+  struct Worker {
+    mutex lock;
+    deque<Task *> queue;
+  };
+  vector<unique_ptr<Worker>> workers;
+  vector<unique_ptr<Task>> tasks;
+  mutex tasksLock;
+  unordered_map<string, shared_ptr<Channel>> channels;
+  mutex channelsLock;
+
+  mutex idleLock;
+  condition_variable idle;
+  long queued = 0;
+  long running = 0;
+  long live = 0;
+  bool deadlocked = false;
+
+  Task *take(size_t index) {
+    for (size_t i = 0; i < workers.size(); i++) {
+      Worker &w = *workers[(index + i) % workers.size()];
+      lock_guard<mutex> guard(w.lock);
+      if (!w.queue.empty()) {
+        Task *task = w.queue.front();
+        w.queue.pop_front();
+        return task;
+      }
+    }
+    return nullptr;
+  }
+
+  void workerLoop(size_t index) {
+    while (true) {
+      if (Task *task = take(index)) {
+        {
+          lock_guard<mutex> guard(idleLock);
+          queued--;
+          running++;
+        }
+        task->worker = index;
+        task->resumePoint.resume();
+        lock_guard<mutex> guard(idleLock);
+        running--;
+        if (live == 0 || (queued <= 0 && running == 0))
+          idle.notify_all();
+        continue;
+      }
+      unique_lock<mutex> guard(idleLock);
+      idle.wait(guard, [&] {
+        return queued > 0 || live == 0 || deadlocked || running == 0;
+      });
+      if (live == 0 || deadlocked)
+        return;
+      if (queued <= 0 && running == 0) {
+        deadlocked = true;
+        idle.notify_all();
+        return;
+      }
+    }
+  }
+
+public:
+  mutex outputLock;
+
+  explicit Scheduler(size_t threads) {
+    for (size_t i = 0; i < max<size_t>(threads, 1); i++)
+      workers.push_back(make_unique<Worker>());
+  }
+
+  bool concurrent() const { return workers.size() > 1; }
+
+  // Queues a suspended task, preferring the queue of the worker doing the
+  // waking so producer/consumer pairs stay local.
+  void schedule(Task *task, coroutine_handle<> h, size_t worker) {
+    task->resumePoint = h;
+    Worker &w = *workers[worker % workers.size()];
+    {
+      lock_guard<mutex> guard(w.lock);
+      w.queue.push_back(task);
+    }
+    lock_guard<mutex> guard(idleLock);
+    queued++;
+    idle.notify_one();
+  }
+
+  Task *spawn(TaskStep body, unique_ptr<Environment> owned, Environment &env,
+              size_t worker) {
+    Task *task;
+    {
+      lock_guard<mutex> guard(tasksLock);
+      tasks.push_back(
+          make_unique<Task>(this, move(owned), env, move(body)));
+      task = tasks.back().get();
+    }
+    task->body.handle.promise().task = task;
+    env.task = task;
+    if (concurrent())
+      env.outputLock = &outputLock;
+    {
+      lock_guard<mutex> guard(idleLock);
+      live++;
+    }
+    schedule(task, task->resumePoint, worker);
+    return task;
+  }
+
+  void finished(Task *task) {
+    lock_guard<mutex> guard(idleLock);
+    live--;
+    if (live == 0)
+      idle.notify_all();
+  }
+
+  void createChannel(const string &name, size_t capacity) {
+    lock_guard<mutex> guard(channelsLock);
+    channels[name] = make_shared<Channel>(capacity);
+  }
+
+  shared_ptr<Channel> channel(const string &name) {
+    lock_guard<mutex> guard(channelsLock);
+    auto it = channels.find(name);
+    return it == channels.end() ? nullptr : it->second;
+  }
+
+  // Runs until every task has finished or all remaining ones are blocked.
+  // Returns the number of tasks left blocked (0 on a clean finish).
+  size_t run() {
+    vector<thread> threads;
+    for (size_t i = 1; i < workers.size(); i++)
+      threads.emplace_back([this, i] { workerLoop(i); });
+    workerLoop(0);
+    for (auto &t : threads)
+      t.join();
+    return deadlocked ? live : 0;
+  }
+
+  // Errors reported by spawned tasks, which each count into their own copy
+  // of the environment.
+  size_t taskErrors(const Environment &root) {
+    size_t total = 0;
+    for (auto &task : tasks)
+      if (&task->env != &root)
+        total += task->env.errors;
+    return total;
+  }
+  AllocationCounters taskAllocations(const Environment &root) {
+    AllocationCounters total;
+    for (auto &task : tasks)
+      if (&task->env != &root)
+        total += task->env.allocations;
+    return total;
+  }
+};
+
+coroutine_handle<> TaskStep::promise_type::FinalAwaiter::await_suspend(
+    coroutine_handle<promise_type> h) noexcept {
+  promise_type &p = h.promise();
+  if (p.continuation)
+    return p.continuation;
+  p.task->scheduler->finished(p.task);
+  return noop_coroutine();
+}
+
+bool Channel::send(Task *task, coroutine_handle<> h, Value &value) {
+  lock_guard<mutex> guard(lock);
+  if (!receivers.empty()) {
+    Waiter r = receivers.front();
+    receivers.pop_front();
+    *r.slot = move(value);
+    task->scheduler->schedule(r.task, r.handle, task->worker);
+    return false;
+  }
+  if (buffer.size() < capacity) {
+    buffer.push_back(move(value));
+    return false;
+  }
+  senders.push_back({task, h, move(value)});
+  return true;
+}
+
+bool Channel::receive(Task *task, coroutine_handle<> h, Value &slot) {
+  lock_guard<mutex> guard(lock);
+  if (!buffer.empty() || !senders.empty()) {
+    if (!buffer.empty()) {
+      slot = move(buffer.front());
+      buffer.pop_front();
+    }
+    if (!senders.empty()) {
+      Waiter s = senders.front();
+      senders.pop_front();
+      if (capacity == 0)
+        slot = move(s.value);
+      else
+        buffer.push_back(move(s.value));
+      task->scheduler->schedule(s.task, s.handle, task->worker);
+    }
+    return false;
+  }
+  receivers.push_back({task, h, Value(), &slot});
+  return true;
+}
+
+struct SendAwaiter {
+  Channel &channel;
+  Value value;
+  bool await_ready() { return false; }
+  bool await_suspend(coroutine_handle<TaskStep::promise_type> h) {
+    return channel.send(h.promise().task, h, value);
+  }
+  void await_resume() {}
+};
+
+struct ReceiveAwaiter {
+  Channel &channel;
+  Value value;
+  bool await_ready() { return false; }
+  bool await_suspend(coroutine_handle<TaskStep::promise_type> h) {
+    return channel.receive(h.promise().task, h, value);
+  }
+  Value await_resume() { return move(value); }
+};
+
+static shared_ptr<Channel> findChannel(Environment &env, const string &name) {
+  shared_ptr<Channel> channel = env.task->scheduler->channel(name);
+  if (!channel) {
+    env.errors++;
+    env.write(env.err, "Error: channel " + name + " not defined.\n");
+  }
+  return channel;
+}
+
+// create channel <name> [with capacity <n>]
+class ChannelCreateStmt : public Stmt {
+  string name;
+  shared_ptr<Expr> capacity;
+
+public:
+  ChannelCreateStmt(string n, shared_ptr<Expr> c) : name(n), capacity(c) {}
+  void execute(Environment &env) override {
+    int64_t n = capacity->evaluate(env).index();
+    env.task->scheduler->createChannel(name, n < 0 ? 0 : n);
+  }
+  bool mayBlock() override { return true; }
+  void infer(TypeScope &scope) override { scope.infer(capacity); }
+  void emit(CppEmitter &out) override { out.unsupported("channels", line); }
+  void save(ProgramWriter &out) override {
+    out.word(N_CHANNEL_CREATE);
+    out.text(name);
+    out.expr(capacity);
+  }
+  void instrument(Instrumenter &in) override { in.operand(capacity); }
+};
+
+// send <value> to <channel>; a list or object is sent as a copy.
+class SendStmt : public Stmt {
+  shared_ptr<Expr> value;
+  string channel;
+
+public:
+  SendStmt(shared_ptr<Expr> v, string c) : value(v), channel(c) {}
+  void execute(Environment &env) override {}
+  bool mayBlock() override { return true; }
+  TaskStep run(Environment &env) override {
+    shared_ptr<Channel> ch = findChannel(env, channel);
+    if (!ch)
+      co_return;
+    // Named awaiters: GCC mishandles temporaries that live across a
+    // suspension point.
+    AggregateCopier copier(env.allocations);
+    SendAwaiter send{*ch, copier.copy(value->evaluate(env))};
+    copier.finish();
+    co_await send;
+  }
+  void infer(TypeScope &scope) override { scope.infer(value); }
+  void emit(CppEmitter &out) override { out.unsupported("channels", line); }
+  void save(ProgramWriter &out) override {
+    out.word(N_SEND);
+    out.expr(value);
+    out.text(channel);
+  }
+  void instrument(Instrumenter &in) override { in.expr(value); }
+};
+
+// receive <variable> from <channel>; defines the variable in this task.
+class ReceiveStmt : public Stmt {
+  Str name;
+  string channel;
+
+public:
+  ReceiveStmt(string n, string c) : name(Str::intern(n)), channel(c) {}
+  void execute(Environment &env) override {}
+  bool mayBlock() override { return true; }
+  TaskStep run(Environment &env) override {
+    shared_ptr<Channel> ch = findChannel(env, channel);
+    if (!ch) {
+      env.define(name, Value(0));
+      co_return;
+    }
+    ReceiveAwaiter receive{*ch, Value()};
+    Value v = co_await receive;
+    env.define(name, v);
+  }
+  void infer(TypeScope &scope) override { scope.define(name, T_UNKNOWN); }
+  void emit(CppEmitter &out) override { out.unsupported("channels", line); }
+  void save(ProgramWriter &out) override {
+    out.word(N_RECEIVE);
+    out.text(name);
+    out.text(channel);
+  }
+  const Str *target() override { return &name; }
+};
+
+// start task ... end task: runs the block as a new task with a deep copy of
+// the current variables.
+class StartTaskStmt : public Stmt {
+  vector<shared_ptr<Stmt>> body;
+
+public:
+  StartTaskStmt(vector<shared_ptr<Stmt>> b) : body(b) {}
+  void execute(Environment &env) override {
+    auto owned = make_unique<Environment>(env);
+    owned->errors = 0;
+    owned->allocations = AllocationCounters();
+    owned->isolate();
+    Environment &taskEnv = *owned;
+    env.task->scheduler->spawn(runBlock(body, taskEnv), move(owned), taskEnv,
+                               env.task->worker);
+  }
+  bool mayBlock() override { return true; }
+  void infer(TypeScope &scope) override {
+    TypeScope task = scope;
+    for (auto &stmt : body)
+      stmt->infer(task);
+  }
+  void emit(CppEmitter &out) override { out.unsupported("tasks", line); }
+  void save(ProgramWriter &out) override {
+    out.word(N_START_TASK);
+    out.block(body);
+  }
+  void instrument(Instrumenter &in) override { in.block(body); }
+};
+
+// Marks the point where --save-snapshot stops a program and captures its
+// state. A no-op in normal runs.
+class CheckpointStmt : public Stmt {
+public:
+  void execute(Environment &env) override {}
+  void emit(CppEmitter &out) override { out.line("// checkpoint"); }
+  void save(ProgramWriter &out) override { out.word(N_CHECKPOINT); }
+};
+
+// --- ESCAPE ANALYSIS ---
+// Most lists and objects created inside a loop are scratch space: filled,
+// read and dropped by the same iteration. Variables are global to a program,
+// so an aggregate escapes its variable only when the variable itself is
+// evaluated somewhere its value is kept: a declaration or `set`, an element
+// or property value, or a `send`. Reads through `at`, `property`,
+// `contains`, `index of`, `sort`, `display` and arithmetic keep nothing.
+// Each `create list` / `create object` in a loop body whose variable never
+// escapes becomes a ScratchDeclStmt, which clears and reuses the aggregate
+// the variable already holds.
+
+// The reuse path of a ScratchDeclStmt, kept as an expression of its own so
+// instrumented runs report it: clears the aggregate the variable holds and
+// yields it. The statement has already checked that the aggregate is not
+// shared. Saved and emitted as the creation it stands for.
+class ScratchReuseExpr : public Expr {
+  Str name;
+  bool list;
+
+public:
+  ScratchReuseExpr(const Str &n, bool l) : name(n), list(l) {}
+  Value evaluate(Environment &env) override {
+    Value *v = env.find(name);
+    if (list) {
+      // clear() keeps the element storage, so refilling to the previous
+      // length allocates nothing.
+      v->list_val->clear();
+      v->list_val->changed();
+    } else {
+      // A fresh table rather than clear(): property order when displayed
+      // follows the table's growth history, which must match a new object.
+      *v->obj_val = ValueMap();
+    }
+    env.allocations.reused++;
+    return *v;
+  }
+  StaticType infer(TypeScope &scope) override {
+    return list ? T_LIST : T_OBJECT;
+  }
+  string emitValue(CppEmitter &out) override {
+    return list ? "nrt::Value::createList()" : "nrt::Value::createObject()";
+  }
+  void save(ProgramWriter &out) override {
+    out.word(list ? N_LIST_CREATE : N_OBJ_CREATE);
+  }
+  bool reuses() override { return true; }
+};
+
+// Replaces a VarDeclStmt that creates a scratch aggregate. Every other hook
+// forwards to the original, so inference, the C++ backend and the cache see
+// the program as written. The aggregate is only reused while the variable
+// holds the sole reference: a task started meanwhile shares its parent's
+// lists, and a `receive` or snapshot can rebind the variable, none of which
+// the analysis tracks.
+class ScratchDeclStmt : public Stmt {
+  shared_ptr<VarDeclStmt> decl;
+  shared_ptr<Expr> reuse;
+  Str name;
+  bool list;
+
+public:
+  ScratchDeclStmt(shared_ptr<VarDeclStmt> d)
+      : decl(d), name(*d->target()), list(d->creates() == T_LIST) {
+    line = d->line;
+    reuse = make_shared<ScratchReuseExpr>(name, list);
+  }
+  void execute(Environment &env) override {
+    const Value *v = env.find(name);
+    if (v && (list ? v->type == Value::V_LIST &&
+                         v->list_val.use_count() == 1
+                   : v->type == Value::V_OBJECT &&
+                         v->obj_val.use_count() == 1)) {
+      reuse->evaluate(env);
+      return;
+    }
+    decl->execute(env);
+  }
+  void infer(TypeScope &scope) override { decl->infer(scope); }
+  void emit(CppEmitter &out) override { decl->emit(out); }
+  void save(ProgramWriter &out) override { decl->save(out); }
+  void instrument(Instrumenter &in) override {
+    decl->instrument(in);
+    in.expr(reuse);
+  }
+  const Str *target() override { return &name; }
+};
+
+class EscapeAnalysis : public Instrumenter {
+  unordered_set<Str, StrHash> escaped;
+  vector<shared_ptr<Stmt> *> candidates; // aggregate declarations in loops
+  size_t loops = 0;
+
+public:
+  void expr(shared_ptr<Expr> &e) override {
+    if (!e)
+      return;
+    if (const Str *name = e->variableName())
+      escaped.insert(*name);
+    e->instrument(*this);
+  }
+  void operand(shared_ptr<Expr> &e) override {
+    if (e)
+      e->instrument(*this);
+  }
+  void block(vector<shared_ptr<Stmt>> &body) override {
+    for (auto &stmt : body) {
+      if (!stmt)
+        continue;
+      auto decl = dynamic_cast<VarDeclStmt *>(stmt.get());
+      if (loops > 0 && decl && decl->creates() != T_UNKNOWN)
+        candidates.push_back(&stmt);
+      stmt->instrument(*this);
+    }
+  }
+  void loop(vector<shared_ptr<Stmt>> &body) override {
+    loops++;
+    block(body);
+    loops--;
+  }
+
+  // Swaps in a ScratchDeclStmt for each declaration found by block() whose
+  // variable never escapes.
+  void rewrite() {
+    for (auto stmt : candidates)
+      if (!escaped.count(*(*stmt)->target()))
+        *stmt = make_shared<ScratchDeclStmt>(
+            static_pointer_cast<VarDeclStmt>(*stmt));
+  }
+};
+
+static void reuseScratchAggregates(vector<shared_ptr<Stmt>> &statements) {
+  EscapeAnalysis analysis;
+  analysis.block(statements);
+  analysis.rewrite();
+}
+
+// --- INSTRUMENTATION ---
+// Observes a run without touching the production engine. instrumentProgram
+// rewrites a parsed tree, wrapping every statement in a ProbedStmt and every
+// non-literal expression in a ProbedExpr. The wrappers report five events to
+// a Probe policy, a plain class whose hooks the template parameter inlines:
+//   statement(env, stmt)           before a statement runs
+//   result(env, line, value)       an expression produced a value
+//   write(env, line, name, value)  a statement wrote a variable
+//   allocate(env, line, value)     a list or object was created
+//   reuse(env, line, value)        a scratch list or object was cleared for
+//                                  reuse instead (see ESCAPE ANALYSIS)
+// Uninstrumented runs execute the original nodes, which contain no hook
+// code at all. TraceProbe (--trace) records events to a binary file that
+// --trace-log prints; DebugProbe (--debug) is an interactive step debugger.
+
+template <class Probe> class ProbedExpr : public Expr {
+  shared_ptr<Expr> inner;
+  Probe &probe;
+  uint32_t line;
+  bool allocating;
+  bool reusing;
+
+public:
+  ProbedExpr(shared_ptr<Expr> e, Probe &p, uint32_t l)
+      : inner(e), probe(p), line(l), allocating(e->allocates()),
+        reusing(e->reuses()) {}
+
+  Value evaluate(Environment &env) override {
+    Value v = inner->evaluate(env);
+    if (allocating)
+      probe.allocate(env, line, v);
+    else if (reusing)
+      probe.reuse(env, line, v);
+    else
+      probe.result(env, line, v);
+    return v;
+  }
+  Num evaluateNum(Environment &env) override {
+    Num n = inner->evaluateNum(env);
+    probe.result(env, line, n.toValue());
+    return n;
+  }
+  bool evaluateCondition(Environment &env) override {
+    bool b = inner->evaluateCondition(env);
+    probe.result(env, line, Value::fromInt(b ? 1 : 0));
+    return b;
+  }
+  StaticType infer(TypeScope &scope) override { return inner->infer(scope); }
+  string emitValue(CppEmitter &out) override { return inner->emitValue(out); }
+  string emitNumber(CppEmitter &out) override {
+    return inner->emitNumber(out);
+  }
+  string emitCondition(CppEmitter &out) override {
+    return inner->emitCondition(out);
+  }
+  bool equalityTest(Str &name, Value &constant) override {
+    return inner->equalityTest(name, constant);
+  }
+  const Str *variableName() override { return inner->variableName(); }
+  const Value *literal() override { return inner->literal(); }
+  void save(ProgramWriter &out) override { inner->save(out); }
+  bool allocates() override { return allocating; }
+  bool reuses() override { return reusing; }
+};
+
+template <class Probe> class ProbedStmt : public Stmt {
+  shared_ptr<Stmt> inner;
+  Probe &probe;
+  const Str *written;
+
+  void wrote(Environment &env) {
+    if (!written)
+      return;
+    if (const Value *v = env.find(*written))
+      probe.write(env, line, *written, *v);
+  }
+
+public:
+  ProbedStmt(shared_ptr<Stmt> s, Probe &p)
+      : inner(s), probe(p), written(s->target()) {
+    line = s->line;
+  }
+
+  void execute(Environment &env) override {
+    probe.statement(env, *inner);
+    inner->execute(env);
+    wrote(env);
+  }
+  bool mayBlock() override { return inner->mayBlock(); }
+  TaskStep run(Environment &env) override {
+    probe.statement(env, *inner);
+    co_await inner->run(env);
+    wrote(env);
+  }
+  void infer(TypeScope &scope) override { inner->infer(scope); }
+  void emit(CppEmitter &out) override { inner->emit(out); }
+  void save(ProgramWriter &out) override { inner->save(out); }
+  const Str *target() override { return written; }
+};
+
+template <class Probe> class ProbeInstrumenter : public Instrumenter {
+  Probe &probe;
+  uint32_t line = 0; // of the statement being instrumented
+
+public:
+  explicit ProbeInstrumenter(Probe &p) : probe(p) {}
+
+  // A literal's result is already in the source, so it is left unwrapped.
+  void expr(shared_ptr<Expr> &e) override {
+    if (!e || e->literal())
+      return;
+    e->instrument(*this);
+    e = make_shared<ProbedExpr<Probe>>(e, probe, line);
+  }
+  void block(vector<shared_ptr<Stmt>> &body) override {
+    for (auto &stmt : body) {
+      // runProgram finds top-level checkpoints by their type.
+      if (!stmt || dynamic_cast<CheckpointStmt *>(stmt.get()))
+        continue;
+      uint32_t outer = line;
+      line = stmt->line;
+      stmt->instrument(*this);
+      stmt = make_shared<ProbedStmt<Probe>>(stmt, probe);
+      line = outer;
+    }
+  }
+};
+
+template <class Probe>
+static void instrumentProgram(vector<shared_ptr<Stmt>> &statements,
+                              Probe &probe) {
+  ProbeInstrumenter<Probe>(probe).block(statements);
+}
+
+// Reports every event to two probes, e.g. --trace together with --debug.
+template <class First, class Second> class ProbePair {
+  First &first;
+  Second &second;
+
+public:
+  ProbePair(First &f, Second &s) : first(f), second(s) {}
+  void statement(Environment &env, const Stmt &stmt) {
+    first.statement(env, stmt);
+    second.statement(env, stmt);
+  }
+  void result(Environment &env, uint32_t line, const Value &v) {
+    first.result(env, line, v);
+    second.result(env, line, v);
+  }
+  void write(Environment &env, uint32_t line, const Str &name,
+             const Value &v) {
+    first.write(env, line, name, v);
+    second.write(env, line, name, v);
+  }
+  void allocate(Environment &env, uint32_t line, const Value &v) {
+    first.allocate(env, line, v);
+    second.allocate(env, line, v);
+  }
+  void reuse(Environment &env, uint32_t line, const Value &v) {
+    first.reuse(env, line, v);
+    second.reuse(env, line, v);
+  }
+};
+
+// Bounded lock-free queue for many producers and one consumer (Vyukov's
+// design). Each slot carries a sequence number saying whose turn it is, so
+// producers claim slots with a single compare-and-swap and the consumer
+// never waits on them.
+template <class T> class RingBuffer {
+  struct Slot {
+    atomic<size_t> sequence;
+    T item;
+  };
+  unique_ptr<Slot[]> slots;
+  size_t mask;
+  alignas(64) atomic<size_t> tail{0}; // next slot to fill
+  alignas(64) atomic<size_t> head{0}; // next slot to drain
+
+public:
+  // capacity must be a power of two.
+  explicit RingBuffer(size_t capacity)
+      : slots(new Slot[capacity]), mask(capacity - 1) {
+    for (size_t i = 0; i < capacity; i++)
+      slots[i].sequence.store(i, memory_order_relaxed);
+  }
+
+  // Moves item in; false if the buffer is full.
+  bool push(T &item) {
+    size_t pos = tail.load(memory_order_relaxed);
+    while (true) {
+      Slot &slot = slots[pos & mask];
+      size_t sequence = slot.sequence.load(memory_order_acquire);
+      intptr_t lag = (intptr_t)sequence - (intptr_t)pos;
+      if (lag == 0) {
+        if (tail.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+          slot.item = move(item);
+          slot.sequence.store(pos + 1, memory_order_release);
+          return true;
+        }
+      } else if (lag < 0) {
+        return false;
+      } else {
+        pos = tail.load(memory_order_relaxed);
+      }
+    }
+  }
+
+  // Consumer only; false if the buffer is empty.
+  bool pop(T &item) {
+    size_t pos = head.load(memory_order_relaxed);
+    Slot &slot = slots[pos & mask];
+    if (slot.sequence.load(memory_order_acquire) != pos + 1)
+      return false;
+    item = move(slot.item);
+    slot.sequence.store(pos + mask + 1, memory_order_release);
+    head.store(pos + 1, memory_order_relaxed);
+    return true;
+  }
+};
+
+// Trace file (--trace): TraceHeader, then one record per event:
+//   byte    kind | value type << 4
+//   varint  line, task, zigzag nanoseconds since the previous record
+//   string  written variable (EV_WRITE only)
+//   value   TV_DOUBLE: 8 bytes; TV_INT: zigzag varint; TV_STRING: string;
+//           TV_LIST / TV_OBJECT: aggregate number, then element count
+// Strings are numbered in order of first use: a number equal to the count
+// so far introduces a new one and is followed by its length and bytes.
+// Tasks and aggregates are numbered from 1 by identity, without a payload;
+// task 0 means the program ran outside the scheduler. An aggregate's number
+// follows its address, so a freed list's number can come back for a new one.
+
+enum TraceKind : uint8_t {
+  EV_STATEMENT,
+  EV_RESULT,
+  EV_WRITE,
+  EV_ALLOC,
+  EV_REUSE
+};
+enum TraceValue : uint8_t {
+  TV_NONE,
+  TV_DOUBLE,
+  TV_INT,
+  TV_STRING,
+  TV_LIST,
+  TV_OBJECT
+};
+
+struct TraceHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+};
+
+static const char TRACE_MAGIC[8] = {'N', 'P', 'P', 'T', 'R', 'A', 'C', 0};
+static const uint32_t TRACE_VERSION = 2;
+
+struct TraceEvent {
+  TraceKind kind = EV_STATEMENT;
+  TraceValue type = TV_NONE;
+  uint32_t line = 0;
+  uint64_t nanos = 0;         // since the trace started
+  const void *task = nullptr; // null outside the scheduler
+  Str name;                   // EV_WRITE: the variable
+  Str text;                   // TV_STRING
+  double num = 0;             // TV_DOUBLE
+  int64_t inum = 0;           // TV_INT
+  const void *ref = nullptr;  // TV_LIST / TV_OBJECT
+  uint64_t size = 0;          // their element count when the event fired
+
+  void capture(const Value &v) {
+    switch (v.type) {
+    case Value::V_NUMBER:
+      type = v.isInt ? TV_INT : TV_DOUBLE;
+      num = v.num;
+      inum = v.inum;
+      break;
+    case Value::V_STRING:
+      type = TV_STRING;
+      text = v.str;
+      break;
+    case Value::V_LIST:
+      type = TV_LIST;
+      ref = v.list_val.get();
+      size = v.list_val->size();
+      break;
+    case Value::V_OBJECT:
+      type = TV_OBJECT;
+      ref = v.obj_val.get();
+      size = v.obj_val->size();
+      break;
+    }
+  }
+};
+
+static uint64_t zigzag(int64_t v) { return ((uint64_t)v << 1) ^ (v >> 63); }
+static int64_t unzigzag(uint64_t v) { return (int64_t)(v >> 1) ^ -(int64_t)(v & 1); }
+
+class TraceEncoder {
+  unordered_map<string, uint64_t> strings;
+  unordered_map<const void *, uint64_t> tasks;
+  unordered_map<const void *, uint64_t> aggregates;
+  uint64_t lastNanos = 0;
+
+  void varint(uint64_t v) {
+    while (v >= 0x80) {
+      bytes += (char)(v | 0x80);
+      v >>= 7;
+    }
+    bytes += (char)v;
+  }
+  void text(const string &s) {
+    auto it = strings.find(s);
+    if (it != strings.end()) {
+      varint(it->second);
+      return;
+    }
+    uint64_t id = strings.size();
+    strings.emplace(s, id);
+    varint(id);
+    varint(s.size());
+    bytes += s;
+  }
+  static uint64_t number(unordered_map<const void *, uint64_t> &ids,
+                         const void *p) {
+    return ids.emplace(p, ids.size() + 1).first->second;
+  }
+
+public:
+  string bytes;
+
+  void event(const TraceEvent &e) {
+    bytes += (char)(e.kind | e.type << 4);
+    varint(e.line);
+    varint(e.task ? number(tasks, e.task) : 0);
+    varint(zigzag((int64_t)(e.nanos - lastNanos)));
+    lastNanos = e.nanos;
+    if (e.kind == EV_WRITE)
+      text(e.name);
+    switch (e.type) {
+    case TV_DOUBLE: {
+      char raw[sizeof(double)];
+      memcpy(raw, &e.num, sizeof(raw));
+      bytes.append(raw, sizeof(raw));
+      break;
+    }
+    case TV_INT:
+      varint(zigzag(e.inum));
+      break;
+    case TV_STRING:
+      text(e.text);
+      break;
+    case TV_LIST:
+    case TV_OBJECT:
+      varint(number(aggregates, e.ref));
+      varint(e.size);
+      break;
+    case TV_NONE:
+      break;
+    }
+  }
+};
+
+// Records events into a RingBuffer; a drain thread encodes them and writes
+// the file, so the traced program only pays for filling a slot. A full
+// buffer makes the producer wait for the drain rather than lose events.
+class TraceProbe {
+  RingBuffer<TraceEvent> ring;
+  ofstream file;
+  chrono::steady_clock::time_point start;
+  atomic<bool> stopping{false};
+  atomic<uint64_t> stalls{0};
+  uint64_t events = 0, bytes = 0; // written by the drain thread
+  thread drainer;
+
+  void drain() {
+    TraceEncoder encoder;
+    TraceEvent e;
+    while (true) {
+      // Read before draining: everything pushed before finish() is seen.
+      bool stop = stopping.load(memory_order_acquire);
+      size_t drained = 0;
+      while (ring.pop(e)) {
+        encoder.event(e);
+        drained++;
+        if (encoder.bytes.size() >= (1 << 16))
+          flush(encoder);
+      }
+      flush(encoder);
+      events += drained;
+      if (stop)
+        return;
+      if (!drained)
+        this_thread::sleep_for(chrono::microseconds(100));
+    }
+  }
+  void flush(TraceEncoder &encoder) {
+    file.write(encoder.bytes.data(), encoder.bytes.size());
+    bytes += encoder.bytes.size();
+    encoder.bytes.clear();
+  }
+
+  void push(TraceEvent &e, Environment &env, uint32_t line) {
+    e.line = line;
+    e.task = env.task;
+    e.nanos = chrono::duration_cast<chrono::nanoseconds>(
+                  chrono::steady_clock::now() - start)
+                  .count();
+    while (!ring.push(e)) {
+      stalls.fetch_add(1, memory_order_relaxed);
+      this_thread::yield();
+    }
+  }
+
+public:
+  explicit TraceProbe(const string &path)
+      : ring(1 << 16), file(path, ios::binary | ios::trunc),
+        start(chrono::steady_clock::now()) {
+    if (!file.is_open())
+      return;
+    TraceHeader header;
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.reserved = 0;
+    file.write((const char *)&header, sizeof(header));
+    bytes = sizeof(header);
+    drainer = thread([this] { drain(); });
+  }
+  ~TraceProbe() { finish(); }
+
+  bool isOpen() const { return file.is_open(); }
+
+  // Drains the remaining events and closes the file.
+  bool finish() {
+    if (drainer.joinable()) {
+      stopping.store(true, memory_order_release);
+      drainer.join();
+      file.close();
+    }
+    return !file.fail();
+  }
+
+  void report(ostream &out) {
+    out << "Trace: " << events << " events, " << bytes << " bytes ("
+        << fixed << setprecision(1)
+        << (events ? (double)bytes / events : 0.0) << " per event), "
+        << stalls.load() << " stall(s) on a full buffer" << endl;
+    out.unsetf(ios::floatfield);
+  }
+
+  void statement(Environment &env, const Stmt &stmt) {
+    TraceEvent e;
+    push(e, env, stmt.line);
+  }
+  void result(Environment &env, uint32_t line, const Value &v) {
+    TraceEvent e;
+    e.kind = EV_RESULT;
+    e.capture(v);
+    push(e, env, line);
+  }
+  void write(Environment &env, uint32_t line, const Str &name,
+             const Value &v) {
+    TraceEvent e;
+    e.kind = EV_WRITE;
+    e.name = name;
+    e.capture(v);
+    push(e, env, line);
+  }
+  void allocate(Environment &env, uint32_t line, const Value &v) {
+    TraceEvent e;
+    e.kind = EV_ALLOC;
+    e.capture(v);
+    push(e, env, line);
+  }
+  void reuse(Environment &env, uint32_t line, const Value &v) {
+    TraceEvent e;
+    e.kind = EV_REUSE;
+    e.capture(v);
+    push(e, env, line);
+  }
+};
+
+// --trace-log: prints a trace file as one line per event. Every read is
+// bounds checked; a malformed file stops the listing with an error.
+class TraceReader {
+  string data;
+  size_t pos = sizeof(TraceHeader);
+  bool ok = true;
+  vector<string> strings;
+
+  uint8_t byte() {
+    if (pos >= data.size()) {
+      ok = false;
+      return 0;
+    }
+    return (uint8_t)data[pos++];
+  }
+  uint64_t varint() {
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64 && ok; shift += 7) {
+      uint8_t b = byte();
+      v |= (uint64_t)(b & 0x7f) << shift;
+      if (!(b & 0x80))
+        return v;
+    }
+    ok = false;
+    return 0;
+  }
+  string text() {
+    uint64_t id = varint();
+    if (id < strings.size())
+      return strings[id];
+    uint64_t length = varint();
+    if (!ok || id != strings.size() || length > data.size() - pos) {
+      ok = false;
+      return "";
+    }
+    strings.push_back(data.substr(pos, length));
+    pos += length;
+    return strings.back();
+  }
+  string value(TraceValue type) {
+    switch (type) {
+    case TV_DOUBLE: {
+      double num = 0;
+      if (data.size() - pos < sizeof(num)) {
+        ok = false;
+        return "";
+      }
+      memcpy(&num, data.data() + pos, sizeof(num));
+      pos += sizeof(num);
+      return Value::formatNumber(num);
+    }
+    case TV_INT:
+      return to_string(unzigzag(varint()));
+    case TV_STRING:
+      return "\"" + text() + "\"";
+    case TV_LIST:
+    case TV_OBJECT: {
+      uint64_t id = varint();
+      uint64_t size = varint();
+      return string(type == TV_LIST ? "list #" : "object #") +
+             to_string(id) + " (" + to_string(size) +
+             (type == TV_LIST ? " items)" : " properties)");
+    }
+    default:
+      return "";
+    }
+  }
+
+public:
+  bool print(const string &path, ostream &out, ostream &err) {
+    ifstream file(path, ios::binary);
+    stringstream buffer;
+    buffer << file.rdbuf();
+    data = buffer.str();
+    if (!file.is_open() || data.size() < sizeof(TraceHeader) ||
+        memcmp(data.data(), TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0 ||
+        ((const TraceHeader *)data.data())->version != TRACE_VERSION) {
+      err << "Error: " << path << " is not a trace file." << endl;
+      return false;
+    }
+    int64_t nanos = 0;
+    out << fixed << setprecision(3);
+    while (pos < data.size() && ok) {
+      uint8_t head = byte();
+      TraceKind kind = (TraceKind)(head & 0xf);
+      TraceValue type = (TraceValue)(head >> 4);
+      uint64_t line = varint();
+      uint64_t task = varint();
+      nanos += unzigzag(varint());
+      string name = kind == EV_WRITE ? text() : "";
+      string shown = value(type);
+      if (!ok || kind > EV_REUSE || type > TV_OBJECT) {
+        ok = false;
+        break;
+      }
+      out << setw(12) << nanos / 1e6 << " ms  ";
+      if (task)
+        out << "task " << task << "  ";
+      out << "line " << line << "  ";
+      switch (kind) {
+      case EV_STATEMENT:
+        out << "statement";
+        break;
+      case EV_RESULT:
+        out << "result " << shown;
+        break;
+      case EV_WRITE:
+        out << "write " << name << " = " << shown;
+        break;
+      case EV_ALLOC:
+        out << "alloc " << shown;
+        break;
+      case EV_REUSE:
+        out << "reuse " << shown;
+        break;
+      }
+      out << '\n';
+    }
+    out.unsetf(ios::floatfield);
+    out << flush;
+    if (!ok)
+      err << "Error: " << path << " is truncated or corrupt." << endl;
+    return ok;
+  }
+};
+
+// --debug: stops before the first statement and after each step, showing
+// the line about to run and the variables each step writes. Commands are
+// read from `commands` and everything the debugger says goes to `out`, so
+// the program's own output is unchanged. Tasks on several threads take
+// turns at the prompt.
+class DebugProbe {
+  istream &commands;
+  ostream &out;
+  vector<string> lines;
+  unordered_set<uint32_t> breakpoints;
+  bool stepping = true;
+  mutex lock;
+
+  string sourceLine(uint32_t line) {
+    return line >= 1 && line <= lines.size() ? lines[line - 1] : "";
+  }
+
+  void show(Environment &env, const Str &name) {
+    out << "  " << name << " = ";
+    if (const Value *v = env.find(name))
+      v->print(out, env.display);
+    else
+      out << "(not defined)" << endl;
+  }
+
+  void prompt(Environment &env, uint32_t line) {
+    env.out << flush;
+    out << "line " << line << ": " << sourceLine(line) << endl;
+    string input;
+    while (true) {
+      out << "(debug) " << flush;
+      if (!getline(commands, input)) {
+        // No more commands: run the rest of the program undisturbed.
+        out << endl;
+        stepping = false;
+        breakpoints.clear();
+        return;
+      }
+      istringstream words(input);
+      string command, argument;
+      words >> command >> argument;
+      if (command.empty() || command == "s" || command == "step") {
+        stepping = true;
+        return;
+      }
+      if (command == "c" || command == "continue") {
+        stepping = false;
+        return;
+      }
+      if (command == "b" || command == "break") {
+        breakpoints.insert((uint32_t)strtoul(argument.c_str(), nullptr, 10));
+      } else if (command == "d" || command == "delete") {
+        breakpoints.erase((uint32_t)strtoul(argument.c_str(), nullptr, 10));
+      } else if (command == "p" || command == "print") {
+        show(env, Str::intern(argument));
+      } else if (command == "v" || command == "vars") {
+        vector<Str> names;
+        for (auto const &pair : env.variables())
+          names.push_back(pair.first);
+        sort(names.begin(), names.end());
+        for (auto &name : names)
+          show(env, name);
+      } else if (command == "l" || command == "list") {
+        uint32_t first = line > 3 ? line - 3 : 1;
+        for (uint32_t i = first; i <= line + 3 && i <= lines.size(); i++)
+          out << (i == line ? "> " : "  ") << setw(4) << i << "  "
+              << lines[i - 1] << endl;
+      } else if (command == "q" || command == "quit") {
+        env.out << flush;
+        if (atQuit)
+          atQuit();
+        exit(0);
+      } else {
+        out << "Commands: step (s, or Enter), continue (c), break <line> "
+               "(b), delete <line> (d), print <variable> (p), vars (v), "
+               "list (l), quit (q)"
+            << endl;
+      }
+    }
+  }
+
+public:
+  // Runs before `quit` ends the process, e.g. to finish a --trace file.
+  function<void()> atQuit;
+
+  DebugProbe(const string &source, istream &in, ostream &o)
+      : commands(in), out(o) {
+    istringstream text(source);
+    string line;
+    while (getline(text, line))
+      lines.push_back(line);
+  }
+
+  void statement(Environment &env, const Stmt &stmt) {
+    lock_guard<mutex> guard(lock);
+    if (stepping || breakpoints.count(stmt.line))
+      prompt(env, stmt.line);
+  }
+  void result(Environment &env, uint32_t line, const Value &v) {}
+  void write(Environment &env, uint32_t line, const Str &name,
+             const Value &v) {
+    lock_guard<mutex> guard(lock);
+    if (!stepping)
+      return;
+    out << "  " << name << " = ";
+    v.print(out, env.display);
+  }
+  void allocate(Environment &env, uint32_t line, const Value &v) {}
+  void reuse(Environment &env, uint32_t line, const Value &v) {}
+};
+
+class Parser {
+  vector<Token> tokens;
+  int current = 0;
+  ostream &err;
+
+  const Token &peek() { return tokens[current]; }
+  const Token &previous() { return tokens[current - 1]; }
+  bool isAtEnd() { return peek().type == EOF_TOK; }
+  const Token &advance() {
     if (!isAtEnd())
       current++;
     return previous();
   }
-  bool match(TokenType t) {
-    if (peek().type == t) {
-      advance();
-      return true;
+  bool match(TokenType t) {
+    if (peek().type == t) {
+      advance();
+      return true;
+    }
+    return false;
+  }
+  void consume(TokenType t, string message) {
+    if (peek().type == t) {
+      advance();
+    } else {
+      errors++;
+      err << message << " found " << peek().lexeme << " on line "
+          << peek().line << endl;
+    }
+  }
+  // Words that are keywords only in one position (`sort`, `contains`,
+  // `index of ... in`, and the task and channel statements) lex as
+  // identifiers, so programs can still use them as variable names; the
+  // parser recognises them by their text.
+  bool isWord(const char *word, size_t ahead = 0) {
+    size_t i = min(current + ahead, tokens.size() - 1);
+    return tokens[i].type == IDENTIFIER && tokens[i].lexeme == word;
+  }
+  bool matchWord(const char *word) {
+    if (!isWord(word))
+      return false;
+    advance();
+    return true;
+  }
+  void consumeWord(const char *word, string message) {
+    if (!matchWord(word)) {
+      errors++;
+      err << message << " found " << peek().lexeme << " on line "
+          << peek().line << endl;
+    }
+  }
+
+  shared_ptr<Expr> expression() { return comparison(); }
+
+  shared_ptr<Expr> comparison() {
+    shared_ptr<Expr> expr = term();
+    while (match(IS) || matchWord("contains")) {
+      if (previous().type == IDENTIFIER) {
+        expr = make_shared<ContainsExpr>(expr, term());
+        continue;
+      }
+      TokenType op = EQUAL;
+      if (match(EQUAL)) {
+        consume(TO, "Expected 'to'");
+        op = EQUAL;
+      } else if (match(LESS)) {
+        consume(THAN, "Expected 'than'");
+        if (match(OR)) {
+          consume(EQUAL, "expected equal");
+          consume(TO, "to");
+        }
+        op = LESS;
+      }
+      shared_ptr<Expr> right = term();
+      expr = make_shared<BinaryExpr>(expr, op, right);
+    }
+    return expr;
+  }
+
+  shared_ptr<Expr> term() {
+    shared_ptr<Expr> expr = factor();
+    while (match(PLUS) || match(MINUS)) {
+      TokenType op = previous().type;
+      shared_ptr<Expr> right = factor();
+      expr = make_shared<BinaryExpr>(expr, op, right);
+    }
+    return expr;
+  }
+
+  shared_ptr<Expr> factor() {
+    shared_ptr<Expr> expr = primary();
+    while (match(TIMES_OP) || match(DIVIDED_BY)) {
+      TokenType op = previous().type;
+      if (op == DIVIDED_BY)
+        consume(BY, "Expected 'by'"); // hacky
+      shared_ptr<Expr> right = primary();
+      expr = make_shared<BinaryExpr>(expr, op, right);
+    }
+    return expr;
+  }
+
+  shared_ptr<Expr> primary() {
+    if (match(NUMBER)) {
+      string text = previous().lexeme;
+      if (text.find('.') == string::npos) {
+        errno = 0;
+        long long n = strtoll(text.c_str(), nullptr, 10);
+        if (errno != ERANGE)
+          return make_shared<LiteralExpr>(Value::fromInt(n));
+      }
+      return make_shared<LiteralExpr>(Value(stod(text)));
+    }
+    if (match(STRING_LIT))
+      return make_shared<LiteralExpr>(Value(Str::intern(previous().lexeme)));
+
+    // DP/OPPS properties in expressions
+    if (match(PROPERTY)) {
+      auto propName = primary();
+      consume(OF, "Expected 'of'");
+      string objName = advance().lexeme;
+      return make_shared<PropertyAccessExpr>(propName, objName);
+    }
+
+    if (match(IDENTIFIER)) {
+      string name = previous().lexeme;
+      // `index` is only a keyword in "index of <value> in <list>".
+      if (name == "index" && match(OF)) {
+        auto value = expression();
+        consumeWord("in", "Expected 'in'");
+        bool sorted = isWord("sorted") && tokens[current + 1].type == IDENTIFIER;
+        if (sorted)
+          advance();
+        return make_shared<IndexOfExpr>(value, primary(), sorted);
+      }
+      if (match(AT)) {
+        auto listIdx = expression();
+        return make_shared<ListAccessExpr>(name, listIdx);
+      }
+      return make_shared<VariableExpr>(name);
+    }
+
+    if (match(LPAREN)) {
+      auto expr = expression();
+      consume(RPAREN, "Expected ')'");
+      return expr;
+    }
+    errors++;
+    err << "Expected expression on line " << peek().line << endl;
+    return make_shared<LiteralExpr>(Value(0));
+  }
+
+public:
+  size_t errors = 0;
+
+  Parser(vector<Token> t, ostream &e) : tokens(move(t)), err(e) {}
+
+  vector<shared_ptr<Stmt>> parse() {
+    vector<shared_ptr<Stmt>> statements;
+    while (!isAtEnd())
+      statements.push_back(statement());
+    return statements;
+  }
+
+  shared_ptr<Stmt> statement() {
+    uint32_t line = (uint32_t)peek().line;
+    shared_ptr<Stmt> stmt = statementBody();
+    stmt->line = line;
+    return stmt;
+  }
+
+  shared_ptr<Stmt> statementBody() {
+    if (match(CREATE)) {
+      if (match(VARIABLE) || match(CONSTANT)) {
+        string name = advance().lexeme;
+        consume(EQUAL, "Expected 'equal'");
+        consume(TO, "Expected 'to'");
+        auto init = expression();
+        return make_shared<VarDeclStmt>(name, init);
+      } else if (match(LIST)) {
+        string name = advance().lexeme;
+        return make_shared<VarDeclStmt>(name, make_shared<ListCreateExpr>());
+      } else if (match(OBJECT)) {
+        string name = advance().lexeme;
+        return make_shared<VarDeclStmt>(name, make_shared<ObjCreateExpr>());
+      } else if (matchWord("channel")) {
+        string name = advance().lexeme;
+        shared_ptr<Expr> capacity =
+            make_shared<LiteralExpr>(Value::fromInt(1));
+        if (isWord("with") && isWord("capacity", 1)) {
+          current += 2;
+          capacity = expression();
+        }
+        return make_shared<ChannelCreateStmt>(name, capacity);
+      }
+    }
+
+    // Set operations
+    if (match(SET)) {
+      if (match(PROPERTY)) {
+        auto propName = primary();
+        consume(OF, "Expected 'of'");
+        string objName = advance().lexeme;
+        consume(TO, "Expected 'to'");
+        auto valExpr = expression();
+        return make_shared<PropertyAssignStmt>(objName, propName, valExpr);
+      } else {
+        string name = advance().lexeme;
+        if (match(AT)) {
+          auto indexExpr = expression();
+          consume(TO, "Expected 'to'");
+          auto valExpr = expression();
+          return make_shared<ListAssignStmt>(name, indexExpr, valExpr);
+        } else {
+          consume(TO, "Expected 'to'");
+          auto val = expression();
+          return make_shared<AssignStmt>(name, val);
+        }
+      }
+    }
+
+    if (match(CHECKPOINT))
+      return make_shared<CheckpointStmt>();
+
+    // No other statement starts with a name, so the task and channel words
+    // are unambiguous here.
+    if (isWord("start") && isWord("task", 1)) {
+      current += 2;
+      vector<shared_ptr<Stmt>> body;
+      while (!isAtEnd() && peek().type != END) {
+        body.push_back(statement());
+      }
+      consume(END, "Expected 'end'");
+      consumeWord("task", "Expected 'task'");
+      return make_shared<StartTaskStmt>(body);
+    }
+    if (matchWord("send")) {
+      auto valExpr = expression();
+      consume(TO, "Expected 'to'");
+      string name = advance().lexeme;
+      return make_shared<SendStmt>(valExpr, name);
+    }
+    if (matchWord("receive")) {
+      string name = advance().lexeme;
+      consumeWord("from", "Expected 'from'");
+      string channel = advance().lexeme;
+      return make_shared<ReceiveStmt>(name, channel);
+    }
+
+    // `sort <list>`; a variable named sort is never a statement of its own.
+    if (isWord("sort") && tokens[current + 1].type == IDENTIFIER) {
+      advance();
+      string name = advance().lexeme;
+      shared_ptr<Expr> key;
+      if (match(BY)) {
+        consume(PROPERTY, "Expected 'property'");
+        key = primary();
+      }
+      return make_shared<SortStmt>(name, key);
+    }
+
+    // Add to list
+    if (match(ADD)) {
+      auto valExpr = expression();
+      consume(TO, "Expected 'to'");
+      string name = advance().lexeme;
+      return make_shared<AddToListStmt>(name, valExpr);
+    }
+
+    if (match(DISPLAY) || match(SHOW)) {
+      return make_shared<PrintStmt>(expression());
+    }
+
+    if (match(WHILE)) {
+      auto condition = expression();
+      consume(DO, "Expected 'do'");
+      vector<shared_ptr<Stmt>> body;
+      while (!isAtEnd() && peek().type != END) {
+        body.push_back(statement());
+      }
+      consume(END, "Expected 'end'");
+      consume(WHILE, "Expected 'while'");
+      return make_shared<WhileStmt>(condition, body);
+    }
+    if (match(REPEAT)) {
+      auto count = expression();
+      consume(TIMES, "Expected 'times'");
+      vector<shared_ptr<Stmt>> body;
+      while (!isAtEnd() && peek().type != END) {
+        body.push_back(statement());
+      }
+      consume(END, "Expected 'end'");
+      consume(REPEAT, "Expected 'repeat'");
+      return make_shared<RepeatStmt>(count, body);
+    }
+    if (match(IF)) {
+      vector<IfStmt::Arm> arms;
+      vector<shared_ptr<Stmt>> otherwise;
+      while (true) {
+        auto condition = expression();
+        consume(THEN, "Expected 'then'");
+        vector<shared_ptr<Stmt>> body;
+        while (!isAtEnd() && peek().type != OTHERWISE && peek().type != END) {
+          body.push_back(statement());
+        }
+        arms.push_back({condition, body});
+        if (!match(OTHERWISE))
+          break;
+        // "otherwise if" continues the chain under the same "end if".
+        if (!match(IF)) {
+          while (!isAtEnd() && peek().type != END) {
+            otherwise.push_back(statement());
+          }
+          break;
+        }
+      }
+      consume(END, "Expected 'end'");
+      consume(IF, "Expected 'if'");
+      return make_shared<IfStmt>(arms, otherwise);
+    }
+
+    // Skip unhandled tokens
+    advance();
+    return make_shared<PrintStmt>(make_shared<LiteralExpr>(Value("")));
+  }
+};
+
+// --- HEAP SNAPSHOTS ---
+// Serialises the environment and every list/object reachable from it to a
+// flat binary file, and restores it by mapping that file into memory.
+//
+// Layout (all records fixed-size, offsets relative to the file start):
+//   SnapshotHeader
+//   SnapshotRange[listCount]    element ranges into the value table
+//   SnapshotRange[objectCount]  key/value pair ranges into the value table
+//   SnapshotRange               the environment's key/value pair range
+//   SnapshotValue[valueCount]   values; object entries are key, value pairs
+//   char[stringBytes]           string pool referenced by SnapshotValue
+// Shared lists and objects are written once and referenced by id, so
+// aliasing survives a round trip.
+
+struct SnapshotHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t listCount;
+  uint64_t objectCount;
+  uint64_t valueCount;
+  uint64_t stringBytes;
+};
+
+struct SnapshotRange {
+  uint64_t first;
+  uint64_t count;
+};
+
+struct SnapshotValue {
+  uint32_t type;
+  uint32_t length; // string length; 1 marks an integer number
+  union {
+    double num;
+    int64_t inum;
+    uint64_t ref; // string pool offset, or list/object id
+  };
+};
+
+static const char SNAPSHOT_MAGIC[8] = {'N', 'P', 'P', 'S', 'N', 'A', 'P', 0};
+static const uint32_t SNAPSHOT_VERSION = 2;
+
+class SnapshotWriter {
+  unordered_map<const vector<Value> *, uint64_t> listIds;
+  unordered_map<const ValueMap *, uint64_t> objectIds;
+  vector<const vector<Value> *> lists;
+  vector<const ValueMap *> objects;
+  vector<SnapshotRange> listRanges;
+  vector<SnapshotRange> objectRanges;
+  vector<SnapshotValue> values;
+  string strings;
+
+  SnapshotValue stringRecord(const string &s) {
+    SnapshotValue rec;
+    rec.type = Value::V_STRING;
+    rec.length = (uint32_t)s.size();
+    rec.ref = strings.size();
+    strings += s;
+    return rec;
+  }
+
+  // Encodes one value, assigning ids to aggregates the first time they are
+  // seen. Their contents are emitted later by the worklist in write().
+  SnapshotValue record(const Value &v) {
+    SnapshotValue rec;
+    rec.type = v.type;
+    rec.length = 0;
+    if (v.type == Value::V_NUMBER && v.isInt) {
+      rec.length = 1;
+      rec.inum = v.inum;
+    } else if (v.type == Value::V_NUMBER) {
+      rec.num = v.num;
+    } else if (v.type == Value::V_STRING) {
+      rec = stringRecord(v.str);
+    } else if (v.type == Value::V_LIST) {
+      auto it = listIds.find(v.list_val.get());
+      if (it == listIds.end()) {
+        it = listIds.emplace(v.list_val.get(), lists.size()).first;
+        lists.push_back(v.list_val.get());
+      }
+      rec.ref = it->second;
+    } else {
+      auto it = objectIds.find(v.obj_val.get());
+      if (it == objectIds.end()) {
+        it = objectIds.emplace(v.obj_val.get(), objects.size()).first;
+        objects.push_back(v.obj_val.get());
+      }
+      rec.ref = it->second;
+    }
+    return rec;
+  }
+
+  SnapshotRange pairs(const ValueMap &map) {
+    // Reserve the slots first: record() may grow the worklists but never
+    // the value table, so the range stays contiguous.
+    SnapshotRange range{values.size(), map.size()};
+    values.resize(values.size() + map.size() * 2);
+    uint64_t slot = range.first;
+    for (auto const &pair : map) {
+      values[slot++] = stringRecord(pair.first);
+      values[slot++] = record(pair.second);
+    }
+    return range;
+  }
+
+public:
+  bool write(const Environment &env, const string &path) {
+    SnapshotRange root = pairs(env.variables());
+    size_t nextList = 0, nextObject = 0;
+    while (nextList < lists.size() || nextObject < objects.size()) {
+      while (nextList < lists.size()) {
+        const vector<Value> &list = *lists[nextList++];
+        SnapshotRange range{values.size(), list.size()};
+        values.resize(values.size() + list.size());
+        for (size_t i = 0; i < list.size(); i++)
+          values[range.first + i] = record(list[i]);
+        listRanges.push_back(range);
+      }
+      while (nextObject < objects.size())
+        objectRanges.push_back(pairs(*objects[nextObject++]));
+    }
+
+    SnapshotHeader header;
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.reserved = 0;
+    header.listCount = listRanges.size();
+    header.objectCount = objectRanges.size();
+    header.valueCount = values.size();
+    header.stringBytes = strings.size();
+
+    ofstream out(path, ios::binary | ios::trunc);
+    if (!out.is_open()) {
+      cerr << "Error: could not write snapshot " << path << endl;
+      return false;
+    }
+    out.write((const char *)&header, sizeof(header));
+    out.write((const char *)listRanges.data(),
+              listRanges.size() * sizeof(SnapshotRange));
+    out.write((const char *)objectRanges.data(),
+              objectRanges.size() * sizeof(SnapshotRange));
+    out.write((const char *)&root, sizeof(root));
+    out.write((const char *)values.data(),
+              values.size() * sizeof(SnapshotValue));
+    out.write(strings.data(), strings.size());
+    return out.good();
+  }
+};
+
+class SnapshotReader {
+  const SnapshotHeader *header = nullptr;
+  const SnapshotRange *listRanges = nullptr;
+  const SnapshotRange *objectRanges = nullptr;
+  const SnapshotRange *root = nullptr;
+  const SnapshotValue *values = nullptr;
+  const char *strings = nullptr;
+  vector<Value> lists;
+  vector<Value> objects;
+
+  bool validRange(const SnapshotRange &r, uint64_t width) const {
+    return r.first <= header->valueCount &&
+           r.count * width <= header->valueCount - r.first;
+  }
+
+  bool decode(const SnapshotValue &rec, Value &out) const {
+    switch (rec.type) {
+    case Value::V_NUMBER:
+      out = rec.length == 1 ? Value::fromInt(rec.inum) : Value(rec.num);
+      return true;
+    case Value::V_STRING:
+      if (rec.ref > header->stringBytes ||
+          rec.length > header->stringBytes - rec.ref)
+        return false;
+      out = Value(string(strings + rec.ref, rec.length));
+      return true;
+    case Value::V_LIST:
+      if (rec.ref >= lists.size())
+        return false;
+      out = lists[rec.ref];
+      return true;
+    case Value::V_OBJECT:
+      if (rec.ref >= objects.size())
+        return false;
+      out = objects[rec.ref];
+      return true;
+    }
+    return false;
+  }
+
+  bool fillPairs(const SnapshotRange &range, ValueMap &map) {
+    if (!validRange(range, 2))
+      return false;
+    map.reserve(range.count);
+    for (uint64_t i = 0; i < range.count; i++) {
+      const SnapshotValue &key = values[range.first + i * 2];
+      Value k, v;
+      if (key.type != Value::V_STRING || !decode(key, k) ||
+          !decode(values[range.first + i * 2 + 1], v))
+        return false;
+      // Keys are interned like the names and property literals they are
+      // looked up with.
+      map.emplace(Str::intern(k.str), move(v));
+    }
+    return true;
+  }
+
+  bool restore(const char *base, size_t size, Environment &env) {
+    if (size < sizeof(SnapshotHeader))
+      return false;
+    header = (const SnapshotHeader *)base;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != SNAPSHOT_VERSION)
+      return false;
+
+    uint64_t tables = header->listCount + header->objectCount + 1;
+    size_t offset = sizeof(SnapshotHeader);
+    if (tables > (size - offset) / sizeof(SnapshotRange))
+      return false;
+    listRanges = (const SnapshotRange *)(base + offset);
+    objectRanges = listRanges + header->listCount;
+    root = objectRanges + header->objectCount;
+    offset += tables * sizeof(SnapshotRange);
+    if (header->valueCount > (size - offset) / sizeof(SnapshotValue))
+      return false;
+    values = (const SnapshotValue *)(base + offset);
+    offset += header->valueCount * sizeof(SnapshotValue);
+    if (header->stringBytes > size - offset)
+      return false;
+    strings = base + offset;
+
+    // Allocate every aggregate up front so references between them (in any
+    // order, including cycles) resolve to the shared instance.
+    lists.reserve(header->listCount);
+    for (uint64_t i = 0; i < header->listCount; i++) {
+      lists.push_back(Value::createList());
+      if (!validRange(listRanges[i], 1))
+        return false;
+      lists.back().list_val->reserve(listRanges[i].count);
+    }
+    objects.reserve(header->objectCount);
+    for (uint64_t i = 0; i < header->objectCount; i++)
+      objects.push_back(Value::createObject());
+
+    for (uint64_t i = 0; i < header->listCount; i++) {
+      vector<Value> &list = *lists[i].list_val;
+      for (uint64_t j = 0; j < listRanges[i].count; j++) {
+        Value v;
+        if (!decode(values[listRanges[i].first + j], v))
+          return false;
+        list.push_back(move(v));
+      }
+    }
+    for (uint64_t i = 0; i < header->objectCount; i++)
+      if (!fillPairs(objectRanges[i], *objects[i].obj_val))
+        return false;
+
+    ValueMap vars;
+    if (!fillPairs(*root, vars))
+      return false;
+    for (auto &pair : vars)
+      env.define(pair.first, pair.second);
+    env.allocations.lists += header->listCount;
+    env.allocations.objects += header->objectCount;
+    return true;
+  }
+
+public:
+  bool read(const string &path, Environment &env) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      cerr << "Error: could not open snapshot " << path << endl;
+      return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+      close(fd);
+      cerr << "Error: invalid snapshot " << path << endl;
+      return false;
+    }
+    void *base = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+      cerr << "Error: could not map snapshot " << path << endl;
+      return false;
+    }
+    bool ok = restore((const char *)base, st.st_size, env);
+    munmap(base, st.st_size);
+    if (!ok)
+      cerr << "Error: invalid snapshot " << path << endl;
+    return ok;
+  }
+};
+
+// --- PROGRAM CACHE ---
+// .nppc files hold one ProgramWriter encoding behind a header:
+//   ProgramHeader
+//   uint64_t[wordCount]   the top-level block
+//   char[stringBytes]     string pool
+//   char[sourceBytes]     the source the program was parsed from
+// The key is a hash of the source and only names the file. The cache
+// directory may be shared between users, and the hash is easy to collide,
+// so a file is used only when its stored source matches byte for byte.
+// Files written with another PROGRAM_VERSION are rejected.
+
+struct ProgramHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t key;
+  uint64_t sourceBytes;
+  uint64_t wordCount;
+  uint64_t stringBytes;
+};
+
+static const char PROGRAM_MAGIC[8] = {'N', 'P', 'P', 'C', 'O', 'D', 'E', 0};
+static const uint32_t PROGRAM_VERSION = 3;
+
+// FNV-1a.
+static uint64_t hashBytes(const char *data, size_t size,
+                          uint64_t h = 14695981039346656037ull) {
+  for (size_t i = 0; i < size; i++) {
+    h ^= (unsigned char)data[i];
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+static uint64_t programKey(const string &source) {
+  uint64_t h = hashBytes((const char *)&PROGRAM_VERSION,
+                         sizeof(PROGRAM_VERSION));
+  return hashBytes(source.data(), source.size(), h);
+}
+
+static bool writeProgram(const vector<shared_ptr<Stmt>> &statements,
+                         const string &source, const string &path) {
+  ProgramWriter writer;
+  writer.block(statements);
+
+  ProgramHeader header;
+  memcpy(header.magic, PROGRAM_MAGIC, sizeof(header.magic));
+  header.version = PROGRAM_VERSION;
+  header.reserved = 0;
+  header.key = programKey(source);
+  header.sourceBytes = source.size();
+  header.wordCount = writer.words.size();
+  header.stringBytes = writer.strings.size();
+
+  ofstream out(path, ios::binary | ios::trunc);
+  if (!out.is_open())
+    return false;
+  out.write((const char *)&header, sizeof(header));
+  out.write((const char *)writer.words.data(),
+            writer.words.size() * sizeof(uint64_t));
+  out.write(writer.strings.data(), writer.strings.size());
+  out.write(source.data(), source.size());
+  return out.good();
+}
+
+// Rebuilds the node tree from a mapped .nppc file. Every read is bounds
+// checked; any inconsistency rejects the whole file.
+class ProgramReader {
+  const uint64_t *words = nullptr;
+  size_t wordCount = 0;
+  size_t pos = 0;
+  const char *strings = nullptr;
+  size_t stringBytes = 0;
+  bool ok = true;
+
+  uint64_t word() {
+    if (pos >= wordCount) {
+      ok = false;
+      return 0;
+    }
+    return words[pos++];
+  }
+
+  string text() {
+    uint64_t offset = word(), length = word();
+    if (offset > stringBytes || length > stringBytes - offset) {
+      ok = false;
+      return "";
+    }
+    return string(strings + offset, length);
+  }
+
+  Value literal() {
+    uint64_t kind = word();
+    if (kind == L_STRING)
+      return Value(Str::intern(text()));
+    uint64_t bits = word();
+    if (kind == L_INT)
+      return Value::fromInt((int64_t)bits);
+    if (kind != L_DOUBLE)
+      ok = false;
+    double d;
+    memcpy(&d, &bits, sizeof(d));
+    return Value(d);
+  }
+
+  // An optional expression: null for N_NONE.
+  shared_ptr<Expr> optional() {
+    switch (word()) {
+    case N_NONE:
+      return nullptr;
+    case N_LITERAL:
+      return make_shared<LiteralExpr>(literal());
+    case N_VARIABLE:
+      return make_shared<VariableExpr>(text());
+    case N_LIST_ACCESS: {
+      string name = text();
+      return make_shared<ListAccessExpr>(name, expr());
+    }
+    case N_PROPERTY_ACCESS: {
+      auto prop = expr();
+      return make_shared<PropertyAccessExpr>(prop, text());
+    }
+    case N_BINARY: {
+      auto left = expr();
+      TokenType op = (TokenType)word();
+      return make_shared<BinaryExpr>(left, op, expr());
+    }
+    case N_OBJ_CREATE:
+      return make_shared<ObjCreateExpr>();
+    case N_LIST_CREATE:
+      return make_shared<ListCreateExpr>();
+    case N_CONTAINS: {
+      auto list = expr();
+      return make_shared<ContainsExpr>(list, expr());
+    }
+    case N_INDEX_OF: {
+      auto value = expr();
+      auto list = expr();
+      return make_shared<IndexOfExpr>(value, list, word() != 0);
+    }
+    default:
+      ok = false;
+      return nullptr;
+    }
+  }
+
+  shared_ptr<Expr> expr() {
+    auto e = optional();
+    if (e)
+      return e;
+    ok = false;
+    return make_shared<LiteralExpr>(Value(0));
+  }
+
+  shared_ptr<Stmt> stmt() {
+    switch (word()) {
+    case N_PRINT:
+      return make_shared<PrintStmt>(expr());
+    case N_VAR_DECL: {
+      string name = text();
+      return make_shared<VarDeclStmt>(name, expr());
+    }
+    case N_ASSIGN: {
+      string name = text();
+      return make_shared<AssignStmt>(name, expr());
+    }
+    case N_LIST_ASSIGN: {
+      string name = text();
+      auto index = expr();
+      return make_shared<ListAssignStmt>(name, index, expr());
+    }
+    case N_PROPERTY_ASSIGN: {
+      string name = text();
+      auto prop = expr();
+      return make_shared<PropertyAssignStmt>(name, prop, expr());
+    }
+    case N_ADD_TO_LIST: {
+      string name = text();
+      return make_shared<AddToListStmt>(name, expr());
+    }
+    case N_SORT: {
+      string name = text();
+      return make_shared<SortStmt>(name, optional());
+    }
+    case N_IF: {
+      uint64_t count = word();
+      vector<IfStmt::Arm> arms;
+      for (uint64_t i = 0; i < count && ok; i++) {
+        auto condition = expr();
+        arms.push_back({condition, block()});
+      }
+      return make_shared<IfStmt>(arms, block());
+    }
+    case N_WHILE: {
+      auto condition = expr();
+      return make_shared<WhileStmt>(condition, block());
+    }
+    case N_REPEAT: {
+      auto count = expr();
+      return make_shared<RepeatStmt>(count, block());
+    }
+    case N_CHANNEL_CREATE: {
+      string name = text();
+      return make_shared<ChannelCreateStmt>(name, expr());
+    }
+    case N_SEND: {
+      auto value = expr();
+      return make_shared<SendStmt>(value, text());
+    }
+    case N_RECEIVE: {
+      string name = text();
+      return make_shared<ReceiveStmt>(name, text());
+    }
+    case N_START_TASK:
+      return make_shared<StartTaskStmt>(block());
+    case N_CHECKPOINT:
+      return make_shared<CheckpointStmt>();
+    default:
+      ok = false;
+      return make_shared<CheckpointStmt>();
+    }
+  }
+
+  vector<shared_ptr<Stmt>> block() {
+    uint64_t count = word();
+    vector<shared_ptr<Stmt>> body;
+    // Each statement takes at least two words: its line and its tag.
+    if (count > (wordCount - pos) / 2) {
+      ok = false;
+      return body;
     }
-    return false;
+    body.reserve(count);
+    for (uint64_t i = 0; i < count && ok; i++) {
+      uint32_t line = (uint32_t)word();
+      body.push_back(stmt());
+      body.back()->line = line;
+    }
+    return body;
   }
-  void consume(TokenType t, string err) {
-    if (peek().type == t)
-      advance();
-    else
-      cerr << err << " found " << peek().lexeme << endl;
+
+public:
+  // Decodes a mapped file written for `source`; false if it is malformed,
+  // has another format version or was written for a different source.
+  bool decode(const char *base, size_t size, const string &source,
+              vector<shared_ptr<Stmt>> &statements) {
+    if (size < sizeof(ProgramHeader))
+      return false;
+    const ProgramHeader *header = (const ProgramHeader *)base;
+    if (memcmp(header->magic, PROGRAM_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != PROGRAM_VERSION ||
+        header->sourceBytes != source.size() ||
+        header->key != programKey(source))
+      return false;
+    size_t body = size - sizeof(ProgramHeader);
+    if (header->sourceBytes > body)
+      return false;
+    body -= header->sourceBytes;
+    if (header->wordCount > body / sizeof(uint64_t) ||
+        header->stringBytes != body - header->wordCount * sizeof(uint64_t) ||
+        memcmp(base + size - header->sourceBytes, source.data(),
+               source.size()) != 0)
+      return false;
+    words = (const uint64_t *)(base + sizeof(ProgramHeader));
+    wordCount = header->wordCount;
+    strings = (const char *)(words + wordCount);
+    stringBytes = header->stringBytes;
+
+    statements = block();
+    return ok && pos == wordCount;
   }
+};
 
-  shared_ptr<Expr> expression() { return comparison(); }
+// Creates `dir` and any missing parents, like mkdir -p.
+static bool makeDirs(const string &dir) {
+  for (size_t i = 1; i <= dir.size(); i++) {
+    if (i < dir.size() && dir[i] != '/')
+      continue;
+    string prefix = dir.substr(0, i);
+    if (mkdir(prefix.c_str(), 0755) != 0 && errno != EEXIST)
+      return false;
+  }
+  return true;
+}
 
-  shared_ptr<Expr> comparison() {
-    shared_ptr<Expr> expr = term();
-    while (match(IS)) {
-      TokenType op = EQUAL;
-      if (match(EQUAL)) {
-        consume(TO, "Expected 'to'");
-        op = EQUAL;
-      } else if (match(LESS)) {
-        consume(THAN, "Expected 'than'");
-        if (match(OR)) {
-          consume(EQUAL, "expected equal");
-          consume(TO, "to");
-        }
-        op = LESS;
-      }
-      shared_ptr<Expr> right = term();
-      expr = make_shared<BinaryExpr>(expr, op, right);
-    }
-    return expr;
+// Content-addressed directory of .nppc files consulted before parsing. Hits
+// refresh the file's modification time. The directory is scanned on the
+// first store and whenever the running size total passes maxBytes; the scan
+// evicts the least recently used files until it fits. Files are
+// written under a temporary name and renamed, so concurrent runs (--batch,
+// cron) never see a partial file. Safe to share between threads.
+class ProgramCache {
+  string dir;
+  uint64_t maxBytes;
+
+  string pathFor(const string &source) const {
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.nppc",
+             (unsigned long long)programKey(source));
+    return dir + "/" + name;
   }
 
-  shared_ptr<Expr> term() {
-    shared_ptr<Expr> expr = factor();
-    while (match(PLUS) || match(MINUS)) {
-      TokenType op = previous().type;
-      shared_ptr<Expr> right = factor();
-      expr = make_shared<BinaryExpr>(expr, op, right);
+
+  // Bytes in the directory as of the last scan plus what this process has
+  // stored since. Files other processes add are only counted at the next
+  // scan, which runs when this estimate passes maxBytes.
+  mutex sizeLock;
+  bool scanned = false;
+  uint64_t totalBytes = 0;
+
+  // Scans the directory and removes the least recently used files until it
+  // fits in maxBytes; returns the bytes left.
+  uint64_t evict() const {
+    DIR *d = opendir(dir.c_str());
+    if (!d)
+      return 0;
+    struct Entry {
+      string path;
+      uint64_t bytes;
+      timespec used;
+    };
+    vector<Entry> entries;
+    uint64_t total = 0;
+    while (dirent *e = readdir(d)) {
+      string name = e->d_name;
+      if (name.size() < 5 || name.compare(name.size() - 5, 5, ".nppc") != 0)
+        continue;
+      struct stat st;
+      string path = dir + "/" + name;
+      if (stat(path.c_str(), &st) != 0)
+        continue;
+      entries.push_back({path, (uint64_t)st.st_size, st.st_mtim});
+      total += st.st_size;
     }
-    return expr;
+    closedir(d);
+    if (total <= maxBytes)
+      return total;
+    sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) {
+      return a.used.tv_sec != b.used.tv_sec ? a.used.tv_sec < b.used.tv_sec
+                                            : a.used.tv_nsec < b.used.tv_nsec;
+    });
+    for (auto &entry : entries) {
+      if (total <= maxBytes)
+        break;
+      if (unlink(entry.path.c_str()) == 0)
+        total -= entry.bytes;
+    }
+    return total;
   }
 
-  shared_ptr<Expr> factor() {
-    shared_ptr<Expr> expr = primary();
-    while (match(TIMES_OP) || match(DIVIDED_BY)) {
-      TokenType op = previous().type;
-      if (op == DIVIDED_BY)
-        consume(BY, "Expected 'by'"); // hacky
-      shared_ptr<Expr> right = primary();
-      expr = make_shared<BinaryExpr>(expr, op, right);
+  void added(uint64_t bytes) {
+    lock_guard<mutex> guard(sizeLock);
+    totalBytes += bytes;
+    if (!scanned || totalBytes > maxBytes) {
+      totalBytes = evict();
+      scanned = true;
     }
-    return expr;
   }
 
-  shared_ptr<Expr> primary() {
-    if (match(NUMBER))
-      return make_shared<LiteralExpr>(Value(stod(previous().lexeme)));
-    if (match(STRING_LIT))
-      return make_shared<LiteralExpr>(Value(previous().lexeme));
+public:
+  atomic<size_t> hits{0};
+  atomic<size_t> misses{0};
+  atomic<uint64_t> hitNanos{0};  // time to map and decode cached programs
+  atomic<uint64_t> missNanos{0}; // time to lex and parse the rest
 
-    // DP/OPPS properties in expressions
-    if (match(PROPERTY)) {
-      auto propName = primary();
-      consume(OF, "Expected 'of'");
-      string objName = advance().lexeme;
-      return make_shared<PropertyAccessExpr>(propName, objName);
-    }
+  ProgramCache(string d, uint64_t max) : dir(d), maxBytes(max) {}
 
-    if (match(IDENTIFIER)) {
-      string name = previous().lexeme;
-      if (match(AT)) {
-        auto listIdx = expression();
-        return make_shared<ListAccessExpr>(name, listIdx);
-      }
-      return make_shared<VariableExpr>(name);
+  bool load(const string &source, vector<shared_ptr<Stmt>> &statements) {
+    string path = pathFor(source);
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+      close(fd);
+      return false;
     }
+    void *base = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+      return false;
+    bool ok =
+        ProgramReader().decode((const char *)base, st.st_size, source,
+                               statements);
+    munmap(base, st.st_size);
+    if (ok)
+      utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+    return ok;
+  }
 
-    if (match(LPAREN)) {
-      auto expr = expression();
-      consume(RPAREN, "Expected ')'");
-      return expr;
+  void store(const string &source,
+             const vector<shared_ptr<Stmt>> &statements) {
+    if (!makeDirs(dir))
+      return;
+    string path = pathFor(source);
+    string temp = path + ".tmp." + to_string(getpid()) + "." +
+                  to_string(hash<thread::id>()(this_thread::get_id()));
+    struct stat st;
+    if (writeProgram(statements, source, temp) && stat(temp.c_str(), &st) == 0 &&
+        rename(temp.c_str(), path.c_str()) == 0)
+      added(st.st_size);
+    else
+      unlink(temp.c_str());
+  }
+
+  void record(bool hit, chrono::steady_clock::duration elapsed) {
+    uint64_t ns = chrono::duration_cast<chrono::nanoseconds>(elapsed).count();
+    if (hit) {
+      hits++;
+      hitNanos += ns;
+    } else {
+      misses++;
+      missNanos += ns;
     }
-    cerr << "Expected expression" << endl;
-    return make_shared<LiteralExpr>(Value(0));
   }
 
-public:
-  Parser(vector<Token> t) : tokens(t) {}
+  void report(ostream &out) const {
+    size_t h = hits, m = misses;
+    ostringstream line;
+    line << fixed << setprecision(1) << "Program cache: " << h << " hits, "
+         << m << " misses (" << (h + m ? 100.0 * h / (h + m) : 0.0)
+         << "% hit rate); " << setprecision(3) << "load "
+         << (h ? hitNanos / 1e6 / h : 0.0) << " ms avg on hit, parse "
+         << (m ? missNanos / 1e6 / m : 0.0) << " ms avg on miss\n";
+    out << line.str();
+  }
+};
 
-  vector<shared_ptr<Stmt>> parse() {
-    vector<shared_ptr<Stmt>> statements;
-    while (!isAtEnd())
-      statements.push_back(statement());
-    return statements;
+// Front-end settings and counters shared by every program compiled in one
+// run of the CLI, reported by --stats.
+struct FrontEnd {
+  unique_ptr<ProgramCache> cache; // null with --no-cache
+  size_t lexThreads = 0;          // most lexer chunks; 0 for one per core
+  atomic<uint64_t> lexBytes{0};
+  atomic<uint64_t> lexTokens{0};
+  atomic<uint64_t> lexChunks{0};
+  atomic<uint64_t> lexNanos{0};
+
+  void report(ostream &out) const {
+    if (cache)
+      cache->report(out);
+    if (lexBytes == 0)
+      return;
+    double ms = lexNanos / 1e6;
+    ostringstream line;
+    line << fixed << setprecision(3) << "Lexer: " << lexBytes / 1e6
+         << " MB, " << lexTokens << " tokens in " << ms << " ms ("
+         << (ms > 0 ? lexBytes / 1e3 / ms : 0.0) << " MB/s), " << lexChunks
+         << " chunk(s)\n";
+    out << line.str();
   }
+};
 
-  shared_ptr<Stmt> statement() {
-    if (match(CREATE)) {
-      if (match(VARIABLE) || match(CONSTANT)) {
-        string name = advance().lexeme;
-        consume(EQUAL, "Expected 'equal'");
-        consume(TO, "Expected 'to'");
-        auto init = expression();
-        return make_shared<VarDeclStmt>(name, init);
-      } else if (match(LIST)) {
-        string name = advance().lexeme;
-        return make_shared<VarDeclStmt>(name, make_shared<ListCreateExpr>());
-      } else if (match(OBJECT)) {
-        string name = advance().lexeme;
-        return make_shared<VarDeclStmt>(name, make_shared<ObjCreateExpr>());
-      }
-    }
+// The cache directory: $NATURAL_CACHE_DIR, else natural/ under
+// $XDG_CACHE_HOME or ~/.cache. Empty if none of those is set.
+static string defaultCacheDir() {
+  if (const char *dir = getenv("NATURAL_CACHE_DIR"))
+    return dir;
+  if (const char *xdg = getenv("XDG_CACHE_HOME"))
+    return string(xdg) + "/natural";
+  if (const char *home = getenv("HOME"))
+    return string(home) + "/.cache/natural";
+  return "";
+}
 
-    // Set operations
-    if (match(SET)) {
-      if (match(PROPERTY)) {
-        auto propName = primary();
-        consume(OF, "Expected 'of'");
-        string objName = advance().lexeme;
-        consume(TO, "Expected 'to'");
-        auto valExpr = expression();
-        return make_shared<PropertyAssignStmt>(objName, propName, valExpr);
-      } else {
-        string name = advance().lexeme;
-        if (match(AT)) {
-          auto indexExpr = expression();
-          consume(TO, "Expected 'to'");
-          auto valExpr = expression();
-          return make_shared<ListAssignStmt>(name, indexExpr, valExpr);
-        } else {
-          consume(TO, "Expected 'to'");
-          auto val = expression();
-          return make_shared<AssignStmt>(name, val);
-        }
-      }
-    }
+// Writes the program as C++ for --emit-cpp, and for --compile builds it into a
+// native executable next to the runtime header. Programs using tasks or
+// channels are reported and nothing is written.
+static bool emitCpp(const vector<shared_ptr<Stmt>> &statements,
+                    const TypeSummary &types, const string &path) {
+  CppEmitter emitter(types);
+  for (auto stmt : statements)
+    if (stmt)
+      stmt->emit(emitter);
+  if (!emitter.failures().empty()) {
+    for (auto &error : emitter.failures())
+      cerr << error << endl;
+    return false;
+  }
+  ofstream out(path, ios::trunc);
+  if (!out.is_open()) {
+    cerr << "Error: could not write " << path << endl;
+    return false;
+  }
+  out << emitter.finish();
+  return out.good();
+}
 
-    // Add to list
-    if (match(ADD)) {
-      auto valExpr = expression();
-      consume(TO, "Expected 'to'");
-      string name = advance().lexeme;
-      return make_shared<AddToListStmt>(name, valExpr);
+// Generated code is compiled with the standard this binary was built with,
+// which the Makefile sets.
+static const char *cxxStandard() {
+  return __cplusplus > 202002L ? "-std=c++23" : "-std=c++20";
+}
+
+// Runs the compiler directly rather than through a shell, so paths are
+// passed through verbatim. $CXX may name a command with leading arguments
+// (e.g. "ccache g++"); it is split on whitespace only.
+static bool compileCpp(const string &cppPath, const string &binaryPath,
+                       const string &self) {
+  const char *cxx = getenv("CXX");
+  const char *runtimeDir = getenv("NATURAL_RUNTIME_DIR");
+  string selfDir = self.find('/') == string::npos
+                       ? "."
+                       : self.substr(0, self.find_last_of('/'));
+  vector<string> args;
+  istringstream compiler(cxx && *cxx ? cxx : "clang++");
+  for (string word; compiler >> word;)
+    args.push_back(word);
+  args.push_back(cxxStandard());
+  args.push_back("-O3");
+  // The Makefile installs natural_runtime.h beside the binary; fall back to
+  // the source tree for in-repo builds.
+  if (runtimeDir) {
+    args.push_back(string("-I") + runtimeDir);
+  } else {
+    args.push_back("-I" + selfDir);
+    args.push_back("-I" + selfDir + "/../src/cpp");
+  }
+  args.push_back(cppPath);
+  args.push_back("-o");
+  args.push_back(binaryPath);
+
+  vector<char *> argv;
+  for (auto &arg : args)
+    argv.push_back(arg.data());
+  argv.push_back(nullptr);
+  cout << flush;
+  cerr << flush;
+  pid_t pid = fork();
+  if (pid == 0) {
+    execvp(argv[0], argv.data());
+    fprintf(stderr, "Error: cannot run %s: %s\n", argv[0], strerror(errno));
+    _exit(127);
+  }
+  int status = 0;
+  if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != 0) {
+    string command;
+    for (auto &arg : args)
+      command += (command.empty() ? "" : " ") + arg;
+    cerr << "Error: C++ compilation failed: " << command << endl;
+    return false;
+  }
+  return true;
+}
+
+static StaticType staticTypeOf(const Value &v) {
+  switch (v.type) {
+  case Value::V_NUMBER:
+    return T_NUMBER;
+  case Value::V_STRING:
+    return T_STRING;
+  case Value::V_LIST:
+    return T_LIST;
+  case Value::V_OBJECT:
+    return T_OBJECT;
+  }
+  return T_UNKNOWN;
+}
+
+// Lexes, parses and type-specialises a program. Variables already in env
+// (e.g. restored from a snapshot) seed the type inference; parse errors are
+// reported to env.err and counted in env.errors. With a cache, a stored
+// parse of the same source replaces the lexer and parser, and clean parses
+// are stored for next time.
+static vector<shared_ptr<Stmt>> compileProgram(const string &source,
+                                               Environment &env,
+                                               TypeScope &types,
+                                               FrontEnd &front) {
+  ProgramCache *cache = front.cache.get();
+  auto start = chrono::steady_clock::now();
+  vector<shared_ptr<Stmt>> statements;
+  if (cache && cache->load(source, statements)) {
+    cache->record(true, chrono::steady_clock::now() - start);
+  } else {
+    size_t chunks;
+    auto lexStart = chrono::steady_clock::now();
+    vector<Token> tokens = tokenizeSource(source, front.lexThreads, &chunks);
+    front.lexNanos += chrono::duration_cast<chrono::nanoseconds>(
+                          chrono::steady_clock::now() - lexStart)
+                          .count();
+    front.lexBytes += source.size();
+    front.lexTokens += tokens.size();
+    front.lexChunks += chunks;
+
+    Parser parser(move(tokens), env.err);
+    statements = parser.parse();
+    env.errors += parser.errors;
+    if (cache) {
+      cache->record(false, chrono::steady_clock::now() - start);
+      // Inference rewrites the tree in place, so store it first.
+      if (parser.errors == 0)
+        cache->store(source, statements);
     }
+  }
 
-    if (match(DISPLAY) || match(SHOW)) {
-      return make_shared<PrintStmt>(expression());
+  for (auto const &pair : env.variables())
+    types.define(pair.first, staticTypeOf(pair.second));
+  for (auto stmt : statements)
+    if (stmt)
+      stmt->infer(types);
+  reuseScratchAggregates(statements);
+  return statements;
+}
+
+// The top level of a program that uses tasks runs as the root task.
+static TaskStep runRoot(const vector<shared_ptr<Stmt>> &statements,
+                        Environment &env, bool stopAtCheckpoint) {
+  for (auto stmt : statements) {
+    if (!stmt)
+      continue;
+    if (stopAtCheckpoint && dynamic_cast<CheckpointStmt *>(stmt.get()))
+      break;
+    if (stmt->mayBlock())
+      co_await stmt->run(env);
+    else
+      stmt->execute(env);
+  }
+}
+
+// Runs a program to completion. Programs that use tasks or channels go
+// through a Scheduler with `threads` workers; everything else executes
+// directly.
+static void runProgram(const vector<shared_ptr<Stmt>> &statements,
+                       Environment &env, bool stopAtCheckpoint,
+                       size_t threads = 1) {
+  bool usesTasks = false;
+  for (auto stmt : statements)
+    if (stmt && stmt->mayBlock())
+      usesTasks = true;
+
+  if (!usesTasks) {
+    for (auto stmt : statements) {
+      if (!stmt)
+        continue;
+      // Only a top-level checkpoint ends the run, so the state written is
+      // always between two whole statements.
+      if (stopAtCheckpoint && dynamic_cast<CheckpointStmt *>(stmt.get()))
+        break;
+      stmt->execute(env);
     }
+    return;
+  }
 
-    if (match(WHILE)) {
-      auto condition = expression();
-      consume(DO, "Expected 'do'");
-      vector<shared_ptr<Stmt>> body;
-      while (!isAtEnd() && peek().type != END) {
-        body.push_back(statement());
-      }
-      consume(END, "Expected 'end'");
-      consume(WHILE, "Expected 'while'");
-      return make_shared<WhileStmt>(condition, body);
+  Scheduler scheduler(threads);
+  scheduler.spawn(runRoot(statements, env, stopAtCheckpoint), nullptr, env, 0);
+  size_t blocked = scheduler.run();
+  env.task = nullptr;
+  env.outputLock = nullptr;
+  env.errors += scheduler.taskErrors(env);
+  env.allocations += scheduler.taskAllocations(env);
+  if (blocked) {
+    env.errors++;
+    env.err << "Error: deadlock, " << blocked
+            << " task(s) blocked on channels." << endl;
+  }
+}
+
+static bool readSource(const string &path, string &source) {
+  ifstream file(path);
+  if (!file.is_open())
+    return false;
+  stringstream buffer;
+  buffer << file.rdbuf();
+  source = buffer.str();
+  return true;
+}
+
+// --- BATCH RUNNER ---
+// Runs every program listed in a manifest (one path per line) on a fixed
+// pool of worker threads, each program in its own Environment with private
+// output buffers.
+//
+// Without an output directory, results are written to stdout as they finish,
+// each framed by a header line
+//   #<index> <status> <stdout bytes> <stderr bytes> <path>
+// followed by exactly that many bytes of stdout, then stderr. With one,
+// <dir>/<index>.out and <dir>/<index>.err hold the streams and
+// <dir>/status.tsv lists index, status, seconds and path in manifest order.
+// The directory is created if missing; a file that cannot be written is
+// reported and makes the batch exit with 1.
+//
+// Status is 0 on a clean run, 1 if the program reported errors and 2 if it
+// could not be read.
+
+struct BatchResult {
+  int status = 0;
+  double seconds = 0;
+  AllocationCounters allocations;
+  string out;
+  string err;
+};
+
+static BatchResult runIsolated(const string &path, const DisplayLimits &display,
+                               FrontEnd &front) {
+  BatchResult result;
+  auto start = chrono::steady_clock::now();
+  string source;
+  if (!readSource(path, source)) {
+    result.status = 2;
+    result.err = "Error: Could not open file " + path + "\n";
+    return result;
+  }
+  ostringstream out, err;
+  Environment env(out, err);
+  env.display = display;
+  TypeScope types;
+  runProgram(compileProgram(source, env, types, front), env, false);
+  result.status = env.errors ? 1 : 0;
+  result.allocations = env.allocations;
+  result.out = out.str();
+  result.err = err.str();
+  result.seconds =
+      chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  return result;
+}
+
+static int runBatch(const string &manifestPath, size_t jobs,
+                    const string &outDir, const DisplayLimits &display,
+                    FrontEnd &front, AllocationCounters &allocations) {
+  string manifest;
+  if (!readSource(manifestPath, manifest)) {
+    cerr << "Error: Could not open manifest " << manifestPath << endl;
+    return 1;
+  }
+  vector<string> paths;
+  istringstream lines(manifest);
+  for (string line; getline(lines, line);) {
+    line.erase(line.find_last_not_of(" \t\r") + 1);
+    line.erase(0, line.find_first_not_of(" \t"));
+    if (!line.empty())
+      paths.push_back(line);
+  }
+
+  if (!outDir.empty() && !makeDirs(outDir)) {
+    cerr << "Error: cannot create output directory " << outDir << ": "
+         << strerror(errno) << endl;
+    return 1;
+  }
+
+  if (jobs == 0)
+    jobs = max(1u, thread::hardware_concurrency());
+  jobs = min(jobs, max<size_t>(paths.size(), 1));
+
+  vector<int> statuses(paths.size());
+  vector<double> seconds(paths.size());
+  vector<AllocationCounters> counters(paths.size());
+  atomic<size_t> next(0);
+  atomic<size_t> failed(0);
+  atomic<bool> unwritten(false); // some result file could not be written
+  mutex outputLock;
+  auto save = [&](const string &path, const string &text) {
+    ofstream file(path, ios::binary | ios::trunc);
+    file << text;
+    file.close();
+    if (file.fail()) {
+      unwritten = true;
+      lock_guard<mutex> guard(outputLock);
+      cerr << "Error: cannot write " << path << endl;
     }
-    if (match(IF)) {
-      auto condition = expression();
-      consume(THEN, "Expected 'then'");
-      vector<shared_ptr<Stmt>> thenBranch;
-      vector<shared_ptr<Stmt>> elseBranch;
-      while (!isAtEnd() && peek().type != OTHERWISE && peek().type != END) {
-        thenBranch.push_back(statement());
-      }
-      if (match(OTHERWISE)) {
-        if (match(IF)) {
-          // nested ifs not mapped properly via 'otherwise if' naive loop
-        } else {
-          while (!isAtEnd() && peek().type != END) {
-            elseBranch.push_back(statement());
-          }
-        }
+  };
+  auto start = chrono::steady_clock::now();
+
+  auto worker = [&]() {
+    for (size_t i = next++; i < paths.size(); i = next++) {
+      BatchResult result = runIsolated(paths[i], display, front);
+      statuses[i] = result.status;
+      seconds[i] = result.seconds;
+      counters[i] = result.allocations;
+      if (result.status != 0)
+        failed++;
+      if (outDir.empty()) {
+        lock_guard<mutex> guard(outputLock);
+        cout << "#" << i << " " << result.status << " " << result.out.size()
+             << " " << result.err.size() << " " << paths[i] << "\n"
+             << result.out << result.err;
+      } else {
+        string base = outDir + "/" + to_string(i);
+        save(base + ".out", result.out);
+        save(base + ".err", result.err);
       }
-      consume(END, "Expected 'end'");
-      consume(IF, "Expected 'if'");
-      return make_shared<IfStmt>(condition, thenBranch, elseBranch);
     }
+  };
+  vector<thread> workers;
+  for (size_t w = 0; w < jobs; w++)
+    workers.emplace_back(worker);
+  for (auto &t : workers)
+    t.join();
+  cout.flush();
+  for (auto &c : counters)
+    allocations += c;
 
-    // Skip unhandled tokens
-    advance();
-    return make_shared<PrintStmt>(make_shared<LiteralExpr>(Value("")));
+  double elapsed =
+      chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  if (!outDir.empty()) {
+    ostringstream status;
+    for (size_t i = 0; i < paths.size(); i++)
+      status << i << "\t" << statuses[i] << "\t" << seconds[i] << "\t"
+             << paths[i] << "\n";
+    save(outDir + "/status.tsv", status.str());
   }
-};
+  cerr << "Batch: " << paths.size() << " programs in " << elapsed << "s ("
+       << (elapsed > 0 ? paths.size() / elapsed : 0) << " programs/s) on "
+       << jobs << " workers, " << failed.load() << " failed" << endl;
+  return failed.load() || unwritten.load() ? 1 : 0;
+}
 
 int main(int argc, char *argv[]) {
-  if (argc < 2)
+  string saveSnapshot, loadSnapshot, emitPath, compilePath, path;
+  string batchManifest, batchOut, cacheDir = defaultCacheDir();
+  string tracePath, traceLog;
+  size_t jobs = 0, threads = 1;
+  uint64_t cacheMegabytes = 64;
+  bool stats = false, debug = false;
+  FrontEnd front;
+  DisplayLimits display;
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if (arg == "--max-elements" && i + 1 < argc)
+      display.maxElements = strtoul(argv[++i], nullptr, 10);
+    else if (arg == "--max-depth" && i + 1 < argc)
+      display.maxDepth = strtoul(argv[++i], nullptr, 10);
+    else if (arg == "--save-snapshot" && i + 1 < argc)
+      saveSnapshot = argv[++i];
+    else if (arg == "--load-snapshot" && i + 1 < argc)
+      loadSnapshot = argv[++i];
+    else if (arg == "--emit-cpp" && i + 1 < argc)
+      emitPath = argv[++i];
+    else if (arg == "--compile" && i + 1 < argc)
+      compilePath = argv[++i];
+    else if (arg == "--batch" && i + 1 < argc)
+      batchManifest = argv[++i];
+    else if (arg == "--batch-out" && i + 1 < argc)
+      batchOut = argv[++i];
+    else if (arg == "--jobs" && i + 1 < argc)
+      jobs = strtoul(argv[++i], nullptr, 10);
+    else if (arg == "--threads" && i + 1 < argc)
+      threads = strtoul(argv[++i], nullptr, 10);
+    else if (arg == "--cache-dir" && i + 1 < argc)
+      cacheDir = argv[++i];
+    else if (arg == "--cache-size" && i + 1 < argc)
+      cacheMegabytes = strtoull(argv[++i], nullptr, 10);
+    else if (arg == "--no-cache")
+      cacheDir.clear();
+    else if (arg == "--stats")
+      stats = true;
+    else if (arg == "--lex-threads" && i + 1 < argc)
+      front.lexThreads = strtoul(argv[++i], nullptr, 10);
+    else if (arg == "--trace" && i + 1 < argc)
+      tracePath = argv[++i];
+    else if (arg == "--trace-log" && i + 1 < argc)
+      traceLog = argv[++i];
+    else if (arg == "--debug")
+      debug = true;
+    else
+      path = arg;
+  }
+  if (!cacheDir.empty())
+    front.cache = make_unique<ProgramCache>(cacheDir, cacheMegabytes << 20);
+  if (!traceLog.empty())
+    return TraceReader().print(traceLog, cout, cerr) ? 0 : 1;
+  if (!batchManifest.empty()) {
+    AllocationCounters allocations;
+    int status =
+        runBatch(batchManifest, jobs, batchOut, display, front, allocations);
+    if (stats) {
+      front.report(cerr);
+      allocations.report(cerr);
+    }
+    return status;
+  }
+  if (path.empty()) {
+    cerr << "Usage: natural [--save-snapshot <file>] [--load-snapshot <file>] "
+            "[--emit-cpp <file.cpp>] [--compile <binary>] "
+            "[--max-elements <n>] [--max-depth <n>] [--threads <n>] "
+            "[--cache-dir <dir>] [--cache-size <MB>] [--no-cache] [--stats] "
+            "[--lex-threads <n>] [--trace <file>] [--debug] "
+            "<file.npp>\n"
+            "       natural --batch <manifest> [--jobs <n>] [--batch-out <dir>]\n"
+            "       natural --trace-log <file>"
+         << endl;
     return 1;
-  ifstream file(argv[1]);
-  stringstream buffer;
-  buffer << file.rdbuf();
-  string source = buffer.str();
+  }
+  // Generated programs start from empty variables; they have no way to
+  // carry a snapshot's state.
+  if (!loadSnapshot.empty() && (!emitPath.empty() || !compilePath.empty())) {
+    cerr << "Error: --load-snapshot cannot be combined with --emit-cpp or "
+            "--compile"
+         << endl;
+    return 1;
+  }
+  string source;
+  readSource(path, source);
 
-  Lexer lexer(source);
-  vector<Token> tokens = lexer.tokenize();
+  Environment env(cout, cerr);
+  env.display = display;
+  if (!loadSnapshot.empty() && !SnapshotReader().read(loadSnapshot, env))
+    return 1;
 
-  Parser parser(tokens);
-  vector<shared_ptr<Stmt>> statements = parser.parse();
+  TypeScope types;
+  vector<shared_ptr<Stmt>> statements =
+      compileProgram(source, env, types, front);
 
-  Environment env;
-  for (auto stmt : statements)
-    if (stmt)
-      stmt->execute(env);
+  if (!emitPath.empty() || !compilePath.empty()) {
+    string cppPath = emitPath.empty() ? compilePath + ".cpp" : emitPath;
+    if (!emitCpp(statements, *types.summary, cppPath))
+      return 1;
+    if (!compilePath.empty() && !compileCpp(cppPath, compilePath, argv[0]))
+      return 1;
+    return 0;
+  }
+
+  // Only instrumented runs pay for probes; see INSTRUMENTATION.
+  unique_ptr<TraceProbe> tracer;
+  unique_ptr<DebugProbe> debugger;
+  unique_ptr<ProbePair<TraceProbe, DebugProbe>> both;
+  if (!tracePath.empty()) {
+    tracer = make_unique<TraceProbe>(tracePath);
+    if (!tracer->isOpen()) {
+      cerr << "Error: cannot write trace " << tracePath << endl;
+      return 1;
+    }
+  }
+  if (debug)
+    debugger = make_unique<DebugProbe>(source, cin, cerr);
+  if (tracer && debugger)
+    debugger->atQuit = [&] {
+      if (!tracer->finish())
+        cerr << "Error: cannot write trace " << tracePath << endl;
+    };
+  if (tracer && debugger) {
+    both = make_unique<ProbePair<TraceProbe, DebugProbe>>(*tracer, *debugger);
+    instrumentProgram(statements, *both);
+  } else if (tracer) {
+    instrumentProgram(statements, *tracer);
+  } else if (debugger) {
+    instrumentProgram(statements, *debugger);
+  }
+
+  runProgram(statements, env, !saveSnapshot.empty(), threads);
+  if (tracer && !tracer->finish()) {
+    cerr << "Error: cannot write trace " << tracePath << endl;
+    return 1;
+  }
+  if (stats) {
+    front.report(cerr);
+    env.allocations.report(cerr);
+    if (tracer)
+      tracer->report(cerr);
+  }
+
+  if (!saveSnapshot.empty() && !SnapshotWriter().write(env, saveSnapshot))
+    return 1;
 
   return 0;
 }
@@ -0,0 +1,724 @@
+// Differential harness: generates random well-formed Natural++ programs,
+// runs each one through the JavaScript transpiler and the native
+// interpreter, and compares what they print and how long they take.
+//
+// Usage: node src/difftest.js [--count 200] [--seed 1] [--size 12]
+//            [--features num,str,if,while,repeat]
+//            [--native bin/natural] [--out difftest-results]
+//            [--iterations 5] [--timeout 2000] [--outlier 4] [--floor 1]
+//        node src/difftest.js --replay program.npp
+//
+// Any program whose output differs, or that is unusually slow natively
+// compared to the rest of the run, is shrunk to a minimal reproducer and
+// saved under --out as <kind>-<seed>.npp.
+
+const fs = require('fs');
+const os = require('os');
+const path = require('path');
+const util = require('util');
+const vm = require('vm');
+const { spawnSync } = require('child_process');
+const NaturalPlusPlusTranspiler = require('./transpiler');
+
+const ALL_FEATURES = ['num', 'str', 'if', 'while', 'repeat', 'list', 'object', 'function', 'logic', 'modulo'];
+// What both paths parse. bin/natural has no functions, `modulo`, `and`/`or`
+// or comparisons beyond `is equal to` and `is less than`, and the transpiler
+// has no lists or objects; the rest are opt-in with --features, where every
+// program using them is expected to mismatch.
+const DEFAULT_FEATURES = ['num', 'str', 'if', 'while', 'repeat'];
+
+function parseArgs(argv) {
+    const options = {
+        count: 200,
+        seed: 1,
+        size: 12,
+        iterations: 5,
+        features: DEFAULT_FEATURES,
+        native: path.resolve(__dirname, '../bin/natural'),
+        out: 'difftest-results',
+        timeout: 2000,
+        outlier: 4,
+        floor: 1,
+        replay: null
+    };
+    for (let i = 0; i < argv.length; i++) {
+        const arg = argv[i];
+        const value = argv[i + 1];
+        if (arg === '--count') options.count = parseInt(value, 10), i++;
+        else if (arg === '--seed') options.seed = parseInt(value, 10), i++;
+        else if (arg === '--size') options.size = parseInt(value, 10), i++;
+        else if (arg === '--iterations') options.iterations = parseInt(value, 10), i++;
+        else if (arg === '--features') options.features = value.split(','), i++;
+        else if (arg === '--native') options.native = path.resolve(value), i++;
+        else if (arg === '--out') options.out = value, i++;
+        else if (arg === '--timeout') options.timeout = parseInt(value, 10), i++;
+        else if (arg === '--outlier') options.outlier = parseFloat(value), i++;
+        else if (arg === '--floor') options.floor = parseFloat(value), i++;
+        else if (arg === '--replay') options.replay = value, i++;
+        else {
+            console.error(`Unknown option ${arg}`);
+            process.exit(2);
+        }
+    }
+    for (const feature of options.features) {
+        if (!ALL_FEATURES.includes(feature)) {
+            console.error(`Unknown feature ${feature}; expected one of ${ALL_FEATURES.join(', ')}`);
+            process.exit(2);
+        }
+    }
+    return options;
+}
+
+// --- PROGRAM GENERATOR ---
+// Programs are built as small syntax trees so the shrinker can work on
+// statements and expressions rather than lines. The generator only emits
+// programs that are valid for both paths as the README describes the
+// language: every variable is created before use and stays in scope,
+// every loop terminates, and nothing divides by zero.
+
+function random(seed) {
+    let state = seed >>> 0;
+    return () => {
+        state = (state + 0x6D2B79F5) >>> 0;
+        let t = state;
+        t = Math.imul(t ^ (t >>> 15), t | 1);
+        t ^= t + Math.imul(t ^ (t >>> 7), t | 61);
+        return ((t ^ (t >>> 14)) >>> 0) / 4294967296;
+    };
+}
+
+const WORDS = ['apple', 'Hello, ', 'x', '', 'one two', 'plus', 'end if', 'note: hi', '42'];
+const DECIMALS = [0.5, 0.1, 0.2, 2.25, 1.5, 3.75];
+const ARITHMETIC = ['plus', 'minus', 'times', 'divided by'];
+const COMPARISONS = ['is equal to', 'is not equal to', 'is greater than', 'is less than',
+    'is greater than or equal to', 'is less than or equal to'];
+
+class Generator {
+    constructor(seed, options) {
+        this.next = random(seed);
+        this.features = new Set(options.features);
+        this.size = options.size;
+        this.iterations = options.iterations;
+        this.names = 0;
+        this.scopes = [[]];
+        this.functions = [];
+        this.statements = 0;
+    }
+
+    pick(items) { return items[Math.floor(this.next() * items.length)]; }
+    chance(p) { return this.next() < p; }
+    has(feature) { return this.features.has(feature); }
+    fresh(prefix) { return `${prefix}${this.names++}`; }
+
+    visible(type) {
+        const found = [];
+        for (const scope of this.scopes)
+            for (const v of scope)
+                if (v.type === type) found.push(v.name);
+        return found;
+    }
+    declare(name, type) { this.scopes[this.scopes.length - 1].push({ name, type }); }
+
+    block(depth, inFunction) {
+        this.scopes.push([]);
+        const body = [];
+        const count = 1 + Math.floor(this.next() * 3);
+        for (let i = 0; i < count; i++) body.push(this.statement(depth + 1, inFunction));
+        this.scopes.pop();
+        return body;
+    }
+
+    program() {
+        const body = [];
+        while (this.statements < this.size) body.push(this.statement(0, false));
+        return body;
+    }
+
+    statement(depth, inFunction) {
+        this.statements++;
+        const kinds = ['create', 'create', 'display', 'display'];
+        if (this.visible('num').length || this.visible('str').length) kinds.push('set', 'set');
+        if (depth < 3) {
+            if (this.has('if')) kinds.push('if');
+            if (this.has('while')) kinds.push('while');
+            if (this.has('repeat')) kinds.push('repeat');
+        }
+        if (this.has('list')) {
+            kinds.push('list');
+            if (this.visible('list').length) kinds.push('add', 'add', 'setat', 'sort', 'display');
+        }
+        if (this.has('object')) {
+            kinds.push('object');
+            if (this.visible('object').length) kinds.push('setprop', 'setprop');
+        }
+        if (this.has('function')) {
+            if (depth === 0 && !inFunction) kinds.push('func');
+            if (this.functions.length) kinds.push('call');
+        }
+
+        switch (this.pick(kinds)) {
+            case 'create': {
+                const type = this.valueType();
+                const node = { k: 'create', name: this.fresh(type === 'num' ? 'n' : 's'), e: this.expr(type, 0) };
+                this.declare(node.name, type);
+                return node;
+            }
+            case 'set': {
+                const type = this.visible('num').length && (!this.visible('str').length || this.chance(0.6)) ? 'num' : 'str';
+                return { k: 'set', name: this.pick(this.visible(type)), e: this.expr(type, 0) };
+            }
+            case 'display':
+                return { k: 'display', e: this.displayable() };
+            case 'if': {
+                const arms = [];
+                const chain = this.visible('num').length && this.chance(0.3);
+                const subject = chain ? this.pick(this.visible('num')) : null;
+                const count = chain ? 4 + Math.floor(this.next() * 3) : 1 + Math.floor(this.next() * 3);
+                for (let i = 0; i < count; i++) {
+                    const c = chain
+                        ? { k: 'cmp', op: 'is equal to', l: { k: 'var', name: subject }, r: { k: 'num', v: i } }
+                        : this.condition(0);
+                    arms.push({ c, body: this.block(depth, inFunction) });
+                }
+                const otherwise = this.chance(0.5) ? this.block(depth, inFunction) : null;
+                return { k: 'if', arms, otherwise };
+            }
+            case 'while':
+                return { k: 'while', counter: this.fresh('w'), bound: 1 + Math.floor(this.next() * this.iterations), body: this.block(depth, inFunction) };
+            case 'repeat':
+                return { k: 'repeat', count: Math.floor(this.next() * (this.iterations + 1)), body: this.block(depth, inFunction) };
+            case 'list': {
+                const node = { k: 'list', name: this.fresh('l') };
+                this.declare(node.name, 'list');
+                return node;
+            }
+            case 'add':
+                return { k: 'add', e: this.expr('num', 0), list: this.pick(this.visible('list')) };
+            case 'setat':
+                return { k: 'setat', list: this.pick(this.visible('list')), i: { k: 'num', v: Math.floor(this.next() * 3) }, e: this.expr('num', 0) };
+            case 'sort':
+                return { k: 'sort', list: this.pick(this.visible('list')) };
+            case 'object': {
+                const node = { k: 'object', name: this.fresh('o') };
+                this.declare(node.name, 'object');
+                return node;
+            }
+            case 'setprop':
+                return { k: 'setprop', obj: this.pick(this.visible('object')), key: this.pick(['a', 'b', 'c']), e: this.expr(this.valueType(), 0) };
+            case 'func': {
+                const name = this.fresh('f');
+                const params = [];
+                const arity = Math.floor(this.next() * 3);
+                this.scopes.push([]);
+                for (let i = 0; i < arity; i++) {
+                    params.push(this.fresh('p'));
+                    this.declare(params[i], 'num');
+                }
+                const body = this.block(depth, true);
+                this.scopes.pop();
+                this.functions.push({ name, arity });
+                return { k: 'func', name, params, body };
+            }
+            case 'call': {
+                const f = this.pick(this.functions);
+                const args = [];
+                for (let i = 0; i < f.arity; i++) args.push(this.expr('num', 1));
+                return { k: 'call', name: f.name, args };
+            }
+        }
+    }
+
+    valueType() { return this.has('str') && this.chance(0.3) ? 'str' : 'num'; }
+
+    displayable() {
+        const options = [this.valueType()];
+        if (this.visible('list').length) options.push('list', 'at');
+        if (this.visible('object').length) options.push('object', 'prop');
+        switch (this.pick(options)) {
+            case 'list': return { k: 'var', name: this.pick(this.visible('list')) };
+            case 'object': return { k: 'var', name: this.pick(this.visible('object')) };
+            case 'at': return { k: 'at', list: this.pick(this.visible('list')), i: { k: 'num', v: Math.floor(this.next() * 3) } };
+            case 'prop': return { k: 'prop', obj: this.pick(this.visible('object')), key: this.pick(['a', 'b', 'c']) };
+            default: return this.expr(options[0], 0);
+        }
+    }
+
+    expr(type, depth) {
+        const vars = this.visible(type);
+        const leaf = depth >= 2 || this.chance(0.45);
+        if (type === 'str') {
+            if (leaf || !this.has('str'))
+                return vars.length && this.chance(0.5) ? { k: 'var', name: this.pick(vars) } : { k: 'str', v: this.pick(WORDS) };
+            return { k: 'bin', op: 'plus', l: this.expr('str', depth + 1), r: this.expr(this.valueType(), depth + 1) };
+        }
+        if (leaf) {
+            if (vars.length && this.chance(0.5)) return { k: 'var', name: this.pick(vars) };
+            if (this.has('list') && this.visible('list').length && this.chance(0.1))
+                return { k: 'indexof', e: this.expr('num', 2), list: this.pick(this.visible('list')) };
+            return { k: 'num', v: this.chance(0.2) ? this.pick(DECIMALS) : Math.floor(this.next() * 20) };
+        }
+        const op = this.pick(this.has('modulo') ? [...ARITHMETIC, 'modulo'] : ARITHMETIC);
+        // Dividing by a non-zero literal keeps Infinity and NaN out of the
+        // comparison; those are checked separately by hand.
+        const r = op === 'divided by' || op === 'modulo'
+            ? { k: 'num', v: 1 + Math.floor(this.next() * 9) }
+            : this.expr('num', depth + 1);
+        return { k: 'bin', op, l: this.expr('num', depth + 1), r };
+    }
+
+    condition(depth) {
+        if (this.has('logic') && depth === 0 && this.chance(0.25))
+            return { k: 'logic', op: this.pick(['and', 'or']), l: this.condition(1), r: this.condition(1) };
+        if (this.has('list') && this.visible('list').length && this.chance(0.15))
+            return { k: 'contains', list: this.pick(this.visible('list')), e: this.expr('num', 2) };
+        const type = this.has('str') && this.visible('str').length && this.chance(0.2) ? 'str' : 'num';
+        const ops = this.has('logic') ? COMPARISONS : ['is equal to', 'is less than'];
+        return { k: 'cmp', op: this.pick(ops), l: this.expr(type, 1), r: this.expr(type, 1) };
+    }
+}
+
+// --- PRINTER ---
+
+function quote(s) { return `"${s}"`; }
+
+function printExpr(e, nested) {
+    let text;
+    switch (e.k) {
+        case 'num': return String(e.v);
+        case 'str': return quote(e.v);
+        case 'var': return e.name;
+        case 'at': return `${e.list} at ${printExpr(e.i, true)}`;
+        case 'prop': return `property ${quote(e.key)} of ${e.obj}`;
+        case 'indexof': text = `index of ${printExpr(e.e, true)} in ${e.list}`; break;
+        case 'contains': text = `${e.list} contains ${printExpr(e.e, true)}`; break;
+        case 'bin':
+        case 'cmp':
+        case 'logic': text = `${printExpr(e.l, true)} ${e.op} ${printExpr(e.r, true)}`; break;
+    }
+    return nested ? `(${text})` : text;
+}
+
+function printBlock(body, indent, lines) {
+    for (const s of body) printStmt(s, indent, lines);
+}
+
+function printStmt(s, indent, lines) {
+    const pad = '    '.repeat(indent);
+    const line = text => lines.push(pad + text);
+    switch (s.k) {
+        case 'create': line(`create variable ${s.name} equal to ${printExpr(s.e)}`); break;
+        case 'set': line(`set ${s.name} to ${printExpr(s.e)}`); break;
+        case 'display': line(`display ${printExpr(s.e)}`); break;
+        case 'list': line(`create list ${s.name}`); break;
+        case 'add': line(`add ${printExpr(s.e)} to ${s.list}`); break;
+        case 'setat': line(`set ${s.list} at ${printExpr(s.i, true)} to ${printExpr(s.e)}`); break;
+        case 'sort': line(`sort ${s.list}`); break;
+        case 'object': line(`create object ${s.name}`); break;
+        case 'setprop': line(`set property ${quote(s.key)} of ${s.obj} to ${printExpr(s.e)}`); break;
+        case 'if':
+            s.arms.forEach((arm, i) => {
+                line(`${i ? 'otherwise if' : 'if'} ${printExpr(arm.c)} then`);
+                printBlock(arm.body, indent + 1, lines);
+            });
+            if (s.otherwise) {
+                line('otherwise');
+                printBlock(s.otherwise, indent + 1, lines);
+            }
+            line('end if');
+            break;
+        case 'while':
+            line(`create variable ${s.counter} equal to 0`);
+            line(`while ${s.counter} is less than ${s.bound} do`);
+            printBlock(s.body, indent + 1, lines);
+            lines.push(`${pad}    set ${s.counter} to ${s.counter} plus 1`);
+            line('end while');
+            break;
+        case 'repeat':
+            line(`repeat ${s.count} times`);
+            printBlock(s.body, indent + 1, lines);
+            line('end repeat');
+            break;
+        case 'func':
+            line(s.params.length
+                ? `define function ${s.name} with parameters ${s.params.join(', ')} as`
+                : `define function ${s.name} as`);
+            printBlock(s.body, indent + 1, lines);
+            line('end function');
+            break;
+        case 'call':
+            line(s.args.length
+                ? `call function ${s.name} with ${s.args.map(a => printExpr(a)).join(', ')}`
+                : `call function ${s.name}`);
+            break;
+    }
+}
+
+function printProgram(body) {
+    const lines = [];
+    printBlock(body, 0, lines);
+    return lines.join('\n') + '\n';
+}
+
+// --- SCOPE CHECK ---
+// The shrinker deletes and splices statements freely; this rejects any
+// candidate that would use a name outside the scope that created it.
+
+function wellFormed(body) {
+    const scopes = [new Map()];
+    const functions = new Map();
+    const lookup = (name, type) => scopes.some(scope => scope.get(name) === type);
+    const exprOk = e => {
+        switch (e.k) {
+            case 'num': case 'str': return true;
+            case 'var': return scopes.some(scope => scope.has(e.name));
+            case 'at': return lookup(e.list, 'list');
+            case 'prop': return lookup(e.obj, 'object');
+            case 'indexof': case 'contains': return lookup(e.list, 'list') && exprOk(e.e);
+            default: return exprOk(e.l) && exprOk(e.r);
+        }
+    };
+    const blockOk = (stmts, fresh) => {
+        scopes.push(fresh || new Map());
+        const ok = stmts.every(stmtOk);
+        scopes.pop();
+        return ok;
+    };
+    const stmtOk = s => {
+        const here = scopes[scopes.length - 1];
+        switch (s.k) {
+            case 'create':
+                if (!exprOk(s.e)) return false;
+                here.set(s.name, 'value');
+                return true;
+            case 'set': return lookup(s.name, 'value') && exprOk(s.e);
+            case 'display': return exprOk(s.e);
+            case 'list': here.set(s.name, 'list'); return true;
+            case 'object': here.set(s.name, 'object'); return true;
+            case 'add': case 'setat': return lookup(s.list, 'list') && exprOk(s.e) && (!s.i || exprOk(s.i));
+            case 'sort': return lookup(s.list, 'list');
+            case 'setprop': return lookup(s.obj, 'object') && exprOk(s.e);
+            case 'if':
+                return s.arms.every(arm => exprOk(arm.c) && blockOk(arm.body)) &&
+                    (!s.otherwise || blockOk(s.otherwise));
+            case 'while': return blockOk(s.body);
+            case 'repeat': return blockOk(s.body);
+            case 'func': {
+                if (scopes.length !== 1) return false;
+                functions.set(s.name, s.params.length);
+                return blockOk(s.body, new Map(s.params.map(p => [p, 'value'])));
+            }
+            case 'call': return functions.get(s.name) === s.args.length && s.args.every(exprOk);
+        }
+        return false;
+    };
+    return body.every(stmtOk);
+}
+
+// --- RUNNERS ---
+
+const transpiler = new NaturalPlusPlusTranspiler();
+let jsStartup = 0;
+
+function runTranspiled(source, timeout) {
+    const output = [];
+    const sandbox = { console: { log: (...args) => output.push(util.format(...args)) } };
+    let error = null;
+    const start = process.hrtime.bigint();
+    try {
+        vm.runInNewContext(transpiler.transpile(source), sandbox, { timeout });
+    } catch (e) {
+        error = e.code === 'ERR_SCRIPT_EXECUTION_TIMEOUT' ? 'timeout' : String(e.message || e);
+    }
+    const ms = Number(process.hrtime.bigint() - start) / 1e6;
+    return { stdout: output.map(line => line + '\n').join(''), error, ms: Math.max(ms - jsStartup, 0) };
+}
+
+const scratch = path.join(os.tmpdir(), `natural_difftest_${process.pid}.npp`);
+let nativeStartup = 0;
+
+function runNative(source, options) {
+    fs.writeFileSync(scratch, source, 'utf-8');
+    const start = process.hrtime.bigint();
+    const result = spawnSync(options.native, ['--no-cache', scratch], {
+        encoding: 'utf-8', timeout: options.timeout, maxBuffer: 64 << 20
+    });
+    const ms = Number(process.hrtime.bigint() - start) / 1e6;
+    let error = null;
+    if (result.error) error = result.error.code === 'ETIMEDOUT' ? 'timeout' : result.error.message;
+    else if (result.status !== 0 || result.stderr) error = (result.stderr || `exit ${result.status}`).trim();
+    return { stdout: result.stdout || '', error, ms: Math.max(ms - nativeStartup, 0) };
+}
+
+// Process start-up and creating a fresh JavaScript context dominate short
+// programs, so both are measured once on an empty program and taken out of
+// every timing.
+function calibrate(options) {
+    const median = run => {
+        const samples = [];
+        for (let i = 0; i < 7; i++) samples.push(run().ms);
+        return samples.sort((a, b) => a - b)[3];
+    };
+    nativeStartup = median(() => runNative('', options));
+    jsStartup = median(() => runTranspiled('', options.timeout));
+}
+
+function compare(source, options) {
+    const js = runTranspiled(source, options.timeout);
+    const native = runNative(source, options);
+    const matched = js.stdout === native.stdout && !js.error === !native.error;
+    return { js, native, matched, timedOut: js.error === 'timeout' || native.error === 'timeout' };
+}
+
+// Timings of a few milliseconds are noisy, so outlier checks take the best
+// of three runs of each path.
+function bestOf(source, options) {
+    let best = null;
+    for (let i = 0; i < 3; i++) {
+        const run = compare(source, options);
+        if (!best) best = run;
+        best.js.ms = Math.min(best.js.ms, run.js.ms);
+        best.native.ms = Math.min(best.native.ms, run.native.ms);
+    }
+    return best;
+}
+
+function ratio(run) { return run.native.ms / Math.max(run.js.ms, 0.05); }
+
+// --- SHRINKER ---
+// Greedy reduction to a fixed point: delete statements, splice a compound
+// statement's body into its parent, drop if arms, shrink loop counts, and
+// replace expressions with an operand or a trivial literal. A candidate is
+// kept only if it is still well formed and still interesting.
+
+function clone(x) { return JSON.parse(JSON.stringify(x)); }
+
+function blocksOf(body, found) {
+    found.push(body);
+    for (const s of body) {
+        if (s.k === 'if') {
+            s.arms.forEach(arm => blocksOf(arm.body, found));
+            if (s.otherwise) blocksOf(s.otherwise, found);
+        } else if (s.body) {
+            blocksOf(s.body, found);
+        }
+    }
+    return found;
+}
+
+function exprSlotsOf(body) {
+    const slots = [];
+    const visit = (owner, key) => {
+        const e = owner[key];
+        slots.push({ owner, key });
+        if (e.l) { visit(e, 'l'); visit(e, 'r'); }
+        if (e.e) visit(e, 'e');
+    };
+    for (const block of blocksOf(body, [])) {
+        for (const s of block) {
+            if (s.e) visit(s, 'e');
+            if (s.args) s.args.forEach((_, i) => visit(s.args, i));
+            if (s.arms) s.arms.forEach(arm => visit(arm, 'c'));
+        }
+    }
+    return slots;
+}
+
+// Each candidate is produced by applying edit `n` to a fresh copy, so the
+// edits can be enumerated without keeping references into old trees.
+function candidates(program) {
+    const edits = [];
+    const blockCount = blocksOf(program, []).length;
+    for (let b = 0; b < blockCount; b++) {
+        const size = blocksOf(program, [])[b].length;
+        for (let i = 0; i < size; i++) {
+            const at = p => blocksOf(p, [])[b];
+            edits.push(p => { at(p).splice(i, 1); });
+            const s = blocksOf(program, [])[b][i];
+            if (s.k === 'if') {
+                s.arms.forEach((_, j) => {
+                    edits.push(p => { at(p).splice(i, 1, ...at(p)[i].arms[j].body); });
+                    if (s.arms.length > 1) edits.push(p => { at(p)[i].arms.splice(j, 1); });
+                });
+                if (s.otherwise) {
+                    edits.push(p => { at(p).splice(i, 1, ...at(p)[i].otherwise); });
+                    edits.push(p => { at(p)[i].otherwise = null; });
+                }
+            } else if (s.body) {
+                edits.push(p => { at(p).splice(i, 1, ...at(p)[i].body); });
+            }
+            if (s.k === 'while' && s.bound > 1) edits.push(p => { at(p)[i].bound = 1; });
+            if (s.k === 'repeat' && s.count > 1) edits.push(p => { at(p)[i].count = 1; });
+        }
+    }
+    const slotCount = exprSlotsOf(program).length;
+    for (let n = 0; n < slotCount; n++) {
+        const replace = pick => p => {
+            const slot = exprSlotsOf(p)[n];
+            const next = pick(slot.owner[slot.key]);
+            if (!next) return false;
+            slot.owner[slot.key] = next;
+        };
+        edits.push(replace(e => e.l));
+        edits.push(replace(e => e.r));
+        edits.push(replace(e => e.k === 'str' ? (e.v === 'a' ? null : { k: 'str', v: 'a' })
+            : e.k === 'num' ? (e.v === 1 ? null : { k: 'num', v: 1 })
+            : e.k === 'bin' || e.k === 'var' || e.k === 'at' || e.k === 'prop' || e.k === 'indexof'
+                ? { k: 'num', v: 1 } : null));
+    }
+    return edits;
+}
+
+function shrink(program, interesting) {
+    let best = program;
+    let progress = true;
+    while (progress) {
+        progress = false;
+        for (const edit of candidates(best)) {
+            const candidate = clone(best);
+            if (edit(candidate) === false || !wellFormed(candidate)) continue;
+            if (interesting(candidate)) {
+                best = candidate;
+                progress = true;
+                break;
+            }
+        }
+    }
+    return best;
+}
+
+// --- REPORTING ---
+
+function excerpt(text) {
+    if (!text) return 'note:   (nothing)';
+    const lines = text.replace(/\n$/, '').split('\n');
+    const shown = lines.slice(0, 8).map(line => `note:   ${line}`);
+    if (lines.length > 8) shown.push(`note:   ... ${lines.length - 8} more line(s)`);
+    return shown.join('\n');
+}
+
+// Generated names only differ by their counter, so reduced programs are
+// renamed from zero before saving.
+function canonical(source) {
+    const names = new Map();
+    return source.replace(/\b([nslofpw])(\d+)\b/g, (name, prefix) => {
+        if (!names.has(name)) names.set(name, prefix + names.size);
+        return names.get(name);
+    });
+}
+
+// Reproducers that differ only in their literals almost always show the
+// same disagreement (`1 divided by 3` and `1 divided by 7`), so only the
+// first of each shape is kept.
+function shape(source) {
+    return source.replace(/"[^"\n]*"/g, '"_"').replace(/\b\d+(\.\d+)?\b/g, '#');
+}
+
+function saveReproducer(options, kind, seed, source, run) {
+    const header = [
+        `note: ${kind} found by src/difftest.js --seed ${seed} --features ${options.features.join(',')}`,
+        `note: transpiler ${run.js.error ? `failed (${run.js.error.split('\n')[0]})` : 'printed'} in ${run.js.ms.toFixed(2)} ms:`,
+        excerpt(run.js.stdout),
+        `note: native ${run.native.error ? `failed (${run.native.error.split('\n')[0]})` : 'printed'} in ${run.native.ms.toFixed(2)} ms:`,
+        excerpt(run.native.stdout),
+        ''
+    ].join('\n');
+    fs.mkdirSync(options.out, { recursive: true });
+    const file = path.join(options.out, `${kind}-${seed}.npp`);
+    fs.writeFileSync(file, header + source, 'utf-8');
+    return file;
+}
+
+function replay(options) {
+    calibrate(options);
+    const source = fs.readFileSync(options.replay, 'utf-8');
+    const run = compare(source, options);
+    for (const [name, result] of [['transpiler', run.js], ['native', run.native]]) {
+        console.log(`--- ${name} (${result.ms.toFixed(2)} ms)${result.error ? ` error: ${result.error}` : ''}`);
+        process.stdout.write(result.stdout);
+    }
+    console.log(run.matched ? '--- outputs match' : '--- outputs differ');
+    process.exit(run.matched ? 0 : 1);
+}
+
+function main() {
+    const options = parseArgs(process.argv.slice(2));
+    if (!fs.existsSync(options.native)) {
+        console.error(`Native interpreter not found at ${options.native}; run make first.`);
+        process.exit(2);
+    }
+    if (options.replay) return replay(options);
+    calibrate(options);
+
+    const seen = new Set();
+    const timings = [];
+    let matched = 0, mismatches = 0, duplicates = 0, timeouts = 0, outliers = 0;
+    let jsTotal = 0, nativeTotal = 0;
+
+    const record = (kind, seed, program, interesting) => {
+        const reduced = shrink(program, interesting);
+        const source = canonical(printProgram(reduced));
+        const key = kind + shape(source);
+        if (seen.has(key)) return false;
+        seen.add(key);
+        const file = saveReproducer(options, kind, seed, source, bestOf(source, options));
+        console.log(`${kind}: seed ${seed} -> ${file}`);
+        return true;
+    };
+
+    for (let i = 0; i < options.count; i++) {
+        const seed = options.seed + i;
+        const program = new Generator(seed, options).program();
+        const run = compare(printProgram(program), options);
+        jsTotal += run.js.ms;
+        nativeTotal += run.native.ms;
+        if (run.timedOut) {
+            // Every generated loop is bounded, so a hang is a bug in one of
+            // the paths. Shrinking would cost a full timeout per candidate,
+            // so the program is saved as generated.
+            const source = canonical(printProgram(program));
+            console.log(`timeout: seed ${seed} -> ${saveReproducer(options, 'timeout', seed, source, run)}`);
+            timeouts++;
+        } else if (!run.matched) {
+            const stillDiffers = p => {
+                const r = compare(printProgram(p), options);
+                return !r.matched && !r.timedOut;
+            };
+            if (record('mismatch', seed, program, stillDiffers)) mismatches++;
+            else duplicates++;
+        } else {
+            matched++;
+        }
+        // Known formatting differences would leave almost nothing to time if
+        // only matching programs counted, so any run that completed on both
+        // paths is a timing sample.
+        if (!run.timedOut && !run.js.error && !run.native.error)
+            timings.push({ seed, program, run });
+    }
+
+    // Native speed relative to the transpiler varies with the mix of
+    // statements, so a program only counts as an outlier when its ratio is
+    // far above the median for this run.
+    const ratios = timings.map(t => ratio(t.run)).sort((a, b) => a - b);
+    const median = ratios.length ? ratios[Math.floor(ratios.length / 2)] : 0;
+    const limit = median * options.outlier;
+    for (const t of timings) {
+        if (t.run.native.ms < options.floor || ratio(t.run) <= limit) continue;
+        const confirmed = bestOf(printProgram(t.program), options);
+        if (confirmed.native.ms < options.floor || ratio(confirmed) <= limit) continue;
+        const stillSlow = p => {
+            const r = bestOf(printProgram(p), options);
+            return !r.js.error && !r.native.error && r.native.ms >= options.floor && ratio(r) > limit;
+        };
+        if (record('slow', t.seed, t.program, stillSlow)) outliers++;
+    }
+
+    console.log(`${options.count} programs: ${matched} matched, ${mismatches} mismatch(es) ` +
+        `(${duplicates} duplicate), ${outliers} performance outlier(s), ${timeouts} timeout(s)`);
+    console.log(`Transpiler: ${jsTotal.toFixed(1)} ms, native: ${nativeTotal.toFixed(1)} ms ` +
+        `(start-up ${jsStartup.toFixed(2)} / ${nativeStartup.toFixed(2)} ms excluded), ` +
+        `median native/transpiler ratio ${median.toFixed(2)} over ${timings.length} program(s)`);
+    fs.rmSync(scratch, { force: true });
+    process.exit(mismatches ? 1 : 0);
+}
+
+main();
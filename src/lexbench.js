@@ -0,0 +1,142 @@
+// Lexer benchmark: generates a large Natural++ source and times the native
+// interpreter's lexer on it with increasing chunk counts (--lex-threads),
+// reporting throughput and speedup over a single chunk.
+//
+// Usage: node src/lexbench.js [--size 22] [--seed 1] [--chunks 1,2,4,8]
+//            [--iterations 3] [--native bin/natural] [--keep big.npp]
+//
+// The generated program mixes the constructs that make chunking hard:
+// strings and comments spanning lines, `note:` inside strings, quotes
+// inside comments and `times` at the start of a line. All of it sits in an
+// `if` that never runs, so each run is lex, parse and exit. Every chunk
+// count must produce the same number of tokens; a mismatch is reported as
+// an error. Speedups are only meaningful on a machine with at least as many
+// cores as chunks.
+
+const fs = require('fs');
+const os = require('os');
+const path = require('path');
+const { spawnSync } = require('child_process');
+
+function parseArgs(argv) {
+    const cores = os.cpus().length;
+    const chunks = [1];
+    for (let n = 2; n <= Math.max(cores, 2); n *= 2) chunks.push(n);
+    const options = {
+        size: 22,
+        seed: 1,
+        chunks,
+        iterations: 3,
+        native: path.resolve(__dirname, '../bin/natural'),
+        keep: null
+    };
+    for (let i = 0; i < argv.length; i++) {
+        const arg = argv[i];
+        const value = argv[i + 1];
+        if (arg === '--size') options.size = parseFloat(value), i++;
+        else if (arg === '--seed') options.seed = parseInt(value, 10), i++;
+        else if (arg === '--chunks') options.chunks = value.split(',').map(n => parseInt(n, 10)), i++;
+        else if (arg === '--iterations') options.iterations = parseInt(value, 10), i++;
+        else if (arg === '--native') options.native = path.resolve(value), i++;
+        else if (arg === '--keep') options.keep = value, i++;
+        else {
+            console.error(`Unknown option ${arg}`);
+            process.exit(2);
+        }
+    }
+    return options;
+}
+
+// Small seeded PRNG (mulberry32), as in difftest.js.
+function random(seed) {
+    let state = seed >>> 0;
+    return () => {
+        state = (state + 0x6d2b79f5) >>> 0;
+        let t = state;
+        t = Math.imul(t ^ (t >>> 15), t | 1);
+        t ^= t + Math.imul(t ^ (t >>> 7), t | 61);
+        return ((t ^ (t >>> 14)) >>> 0) / 4294967296;
+    };
+}
+
+function generate(megabytes, seed) {
+    const next = random(seed);
+    const pick = n => Math.floor(next() * n);
+    const name = () => 'v' + pick(500);
+    const number = () => String(pick(100000));
+    const pieces = [
+        () => `create variable ${name()} equal to ${number()} plus ${name()} times (${number()} minus 2)\n`,
+        () => `set ${name()} to ${name()} divided by ${number()}\n`,
+        () => `display "record ${number()} with note: inside the string"\n`,
+        () => `display "first line\nsecond line ${number()}\n"\n`,
+        () => `note: a comment with a "quote and ${name()}\n`,
+        () => `repeat ${number()}\ntimes\n    add ${number()} to ${name()}\nend repeat\n`,
+        () => `set ${name()} at ${number()} to "item ${number()}"\n`,
+        () => `if ${name()} is equal to "a\n\nb" then\n    display ${name()} plus "x"\nend if\n`,
+        () => `while ${name()} is less than ${number()} do\n    set ${name()} to ${name()} plus 1\nend while\n`,
+        () => `set property "p${pick(50)}" of ${name()} to property "q" of ${name()}\n`
+    ];
+    const target = megabytes * 1e6;
+    const parts = ['if 0 is equal to 1 then\n'];
+    let bytes = parts[0].length;
+    while (bytes < target) {
+        const piece = pieces[pick(pieces.length)]();
+        parts.push(piece);
+        bytes += piece.length;
+    }
+    parts.push('end if\ndisplay "done"\n');
+    return parts.join('');
+}
+
+// One run; the Lexer line of --stats gives the lexer's own time.
+function run(options, file, chunks) {
+    const start = process.hrtime.bigint();
+    const result = spawnSync(options.native,
+        ['--no-cache', '--stats', '--lex-threads', String(chunks), file],
+        { encoding: 'utf-8', maxBuffer: 1 << 26 });
+    const wall = Number(process.hrtime.bigint() - start) / 1e6;
+    const match = /Lexer: ([\d.]+) MB, (\d+) tokens in ([\d.]+) ms .*?(\d+) chunk/.exec(result.stderr || '');
+    if (result.status !== 0 || !match || result.stdout !== 'done\n') {
+        console.error(`Error: ${options.native} failed with --lex-threads ${chunks}`);
+        console.error(result.stderr || result.error);
+        process.exit(1);
+    }
+    return { tokens: parseInt(match[2], 10), lexMs: parseFloat(match[3]), used: parseInt(match[4], 10), wall };
+}
+
+function main() {
+    const options = parseArgs(process.argv.slice(2));
+    const file = options.keep || path.join(os.tmpdir(), `lexbench-${process.pid}.npp`);
+    const source = generate(options.size, options.seed);
+    fs.writeFileSync(file, source);
+    const mb = source.length / 1e6;
+    console.log(`${mb.toFixed(1)} MB source, ${os.cpus().length} core(s), best of ${options.iterations}`);
+    console.log('chunks  used   lexer ms     MB/s  speedup   wall ms');
+
+    let baseline = null;
+    let tokens = null;
+    for (const chunks of options.chunks) {
+        let best = null;
+        for (let i = 0; i < options.iterations; i++) {
+            const r = run(options, file, chunks);
+            if (tokens === null) tokens = r.tokens;
+            if (r.tokens !== tokens) {
+                console.error(`Error: ${r.tokens} tokens with ${chunks} chunk(s), ${tokens} with one`);
+                process.exit(1);
+            }
+            if (!best || r.lexMs < best.lexMs) best = r;
+        }
+        if (baseline === null) baseline = best.lexMs;
+        console.log([
+            String(chunks).padStart(6),
+            String(best.used).padStart(5),
+            best.lexMs.toFixed(1).padStart(10),
+            (mb / (best.lexMs / 1e3)).toFixed(1).padStart(8),
+            (baseline / best.lexMs).toFixed(2).padStart(7) + 'x',
+            best.wall.toFixed(0).padStart(9)
+        ].join(' '));
+    }
+    if (!options.keep) fs.unlinkSync(file);
+}
+
+main();
@@ -0,0 +1,25 @@
+#!/bin/sh
+# Runs every tests/<name>.npp with the interpreter and compares its stdout
+# with <name>.out and its stderr with <name>.err (empty when there is no
+# .err file). Usage: tests/run.sh [path/to/natural]
+natural=${1:-bin/natural}
+dir=$(dirname "$0")
+actual=$(mktemp -d)
+trap 'rm -rf "$actual"' EXIT
+failed=0
+for program in "$dir"/*.npp; do
+    name=$(basename "$program" .npp)
+    "$natural" --no-cache "$program" >"$actual/out" 2>"$actual/err"
+    expected_err=/dev/null
+    [ -f "$dir/$name.err" ] && expected_err="$dir/$name.err"
+    if cmp -s "$actual/out" "$dir/$name.out" &&
+        cmp -s "$actual/err" "$expected_err"; then
+        echo "ok    $name"
+    else
+        echo "FAIL  $name"
+        diff "$dir/$name.out" "$actual/out"
+        diff "$expected_err" "$actual/err"
+        failed=1
+    fi
+done
+exit $failed
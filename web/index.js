@@ -37,7 +37,9 @@ app.post('/api/run', (req, res) => {
 
     fs.writeFileSync(tmpFile, code, 'utf-8');
 
-    const cmd = `${getCompilerPath()} "${tmpFile}"`;
+    // Cap how much of a huge or deeply nested list/object gets sent back
+    // to the browser.
+    const cmd = `${getCompilerPath()} --max-elements 1000 --max-depth 16 "${tmpFile}"`;
 
     exec(cmd, { timeout: 5000 }, (error, stdout, stderr) => {
         // Clean up file